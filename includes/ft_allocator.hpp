@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <malloc.h>
+
+namespace ft {
+
+// std-conforming allocator on top of the pools, deallocate knows the size so
+// it always takes the sized free path
+template <typename T>
+class allocator {
+public:
+  typedef T value_type;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  allocator() noexcept {}
+  template <typename U>
+  allocator(const allocator<U>&) noexcept {}
+
+  T* allocate(size_type n) {
+    if (n > static_cast<size_type>(-1) / sizeof(T))
+      throw std::bad_array_new_length();
+    size_type size = n ? n * sizeof(T) : 1;
+    void* ptr = alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? aligned_alloc(alignof(T), size) : malloc(size);
+    if (!ptr)
+      throw std::bad_alloc();
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, size_type n) noexcept {
+    size_type size = n ? n * sizeof(T) : 1;
+    if (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+      free_aligned_sized(ptr, alignof(T), size);
+    else
+      free_sized(ptr, size);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+  return false;
+}
+
+}
@@ -16,25 +16,68 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/auxv.h>
 #ifndef __USE_MISC
 # define  __USE_MISC
 #endif
 #include <sys/mman.h>
 #include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <size_classes.h>
 
-#define TINY_POOL_SIZE_MULTIPLIER 128 // * PAGE_SIZE
-#define SMALL_POOL_SIZE_MULTIPLIER 1024 // * PAGE_SIZE
+// pool sizes, thresholds and HEAP_POOLS come from size_classes.h
 
-#define TINY_POOL_CHUNK_MAX_SIZE_MULTIPLIER(x) (x / 300)
-#define SMALL_POOL_CHUNK_MAX_SIZE_MULTIPLIER(x) (x / 50)
-
-#define HEAP_POOLS 2
-#define TINY_POOL_IDX 0
-#define SMALL_POOL_IDX 1
+#define HEAP_MAX_ARENAS 16
+#define NUMA_MAX_NODES 64
+#define NUMA_MPOL_PREFERRED 1 // from <numaif.h>, we don't want to depend on libnuma
+#define ARENA_REFRESH 64 // calls a thread keeps its arena before asking which cpu it's on again
 
 #define ALIGNMENT 16
 
+#define GUARD_QUARANTINE_SIZE 16 // freed guarded allocations kept PROT_NONE to catch use after free
+#define CHUNK_FREED_POISON 0xdeadf7eeU
+
+#define PRESSURE_MAX_CALLBACKS 8
+
+#define POOL_MAX_ZONES 64 // a pool is split in at most this many zones to track occupancy
+#define ZONE_SCAN_LIMIT 32 // chunks looked at past the first fit for one in a fuller zone
+#define ZONE_DRAIN_BATCH 4 // empty zones to wait for before giving their pages back
+
+#define EPOCH_MAX_THREADS 64 // the next thread gets EAGAIN from malloc_epoch_enter and free_deferred
+#define EPOCH_BATCH 32 // pointers a thread retires before handing them over under the lock
+#define EPOCH_EXIT_INTERVAL 64 // critical sections a thread leaves between two tries at advancing the epoch
+
+#define SIZE_HIST_BUCKETS 256 // 4 per power of 2 of the chunk size
+#define ADAPT_WINDOW 4096 // samples between two threshold updates
+#define POOL_MIN_CHUNKS 32 // a pool always fits at least this many of its biggest chunks
+
+#define RESERVE_REGIONS 4 // FT_MALLOC_RESERVE is mapped in regions of a quarter of it
+#define RESERVE_MAX_REGIONS 32 // regions and leftovers of regions kept at once
+
+#define STAT_BUCKETS 40 // bucket b counts latencies in [2^(b-1), 2^b) ns, the last one everything above
+
+// what FT_MALLOC_STATS keeps a latency histogram of, whole calls first, then the paths inside them
+typedef enum e_stat
+{
+  STAT_MALLOC,
+  STAT_MALLOC_FAST, // malloc_tiny/malloc_small
+  STAT_FREE,
+  STAT_REALLOC,
+  STAT_LOCK_WAIT, // uncontended acquisitions land in the first bucket
+  STAT_POOL_SCAN,
+  STAT_SPLIT,
+  STAT_MERGE,
+  STAT_MMAP,
+  STAT_MUNMAP,
+  STAT_COUNT
+} t_stat;
+
 #define MMAP_FLAGS PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0
 
 // an alloc
@@ -42,6 +85,7 @@ typedef struct s_chunk
 {
   size_t size; // size of the segment after this header
   bool used; // is the segment in use
+  uint32_t canary; // header checksum, only kept with FT_MALLOC_HARDEN (fits in the padding after used)
   struct s_chunk* next; // next chunk in the pool
   struct s_chunk* prev; // prev chunk in the pool
 } t_chunk;
@@ -57,26 +101,169 @@ typedef struct s_pool
   t_chunk* chunks; // list of mapped chunks
   t_chunk* last_chunk; // ptr to the last chunk in the pool
   t_chunk* free_chunks; // ptr to the first unused chunk, so that malloc can be at least O(1)
+  void* touched; // end of the pages written so far, everything before it counts as resident
+  uint64_t purged[(POOL_MAX_PAGES + 63) / 64]; // pages under touched given back to the os, one bit each
+  size_t purged_bytes; // 0 most of the time, so reusing a chunk can skip the bitmap
+  uint8_t zone_shift; // zones are 1 << zone_shift bytes
+  uint64_t drain_pending; // zones that went empty since the last drain, one bit each
+  uint32_t zone_used[POOL_MAX_ZONES]; // used bytes in each zone, only kept with FT_MALLOC_DRAIN
 } t_pool;
 
-typedef struct s_heap
+// a freed guarded allocation, kept inaccessible until it gets evicted
+typedef struct s_guard_slot
+{
+  void* data; // what the user got, to tell double frees apart
+  void* base; // mapping start
+  size_t len; // mapping length, guard page included
+} t_guard_slot;
+
+// called outside the lock once the heap goes past the soft limit
+typedef struct s_pressure_callback
+{
+  void (*callback)(size_t resident, size_t soft_limit, void* arg);
+  void* arg;
+} t_pressure_callback;
+
+// pages mapped ahead of time by the provisioner thread, not touched yet (or only prefaulted)
+typedef struct s_reserve_region
+{
+  void* addr;
+  size_t len;
+} t_reserve_region;
+
+// one per registered thread, written by its owner and read by whoever advances the epoch
+typedef struct s_epoch_record
+{
+  uint64_t state; // (epoch << 1) | 1 inside a critical section, 0 outside
+  uint32_t depth; // nested enters
+  uint32_t count; // pointers waiting in retired
+  uint32_t exits; // outermost exits so far
+  bool registered;
+  void* retired[EPOCH_BATCH];
+} __attribute__((aligned(64))) t_epoch_record;
+
+// retired pointers handed over together, allocated from the heap itself
+typedef struct s_retire_batch
+{
+  struct s_retire_batch* next;
+  size_t count;
+  void* ptrs[EPOCH_BATCH];
+} t_retire_batch;
+
+// a set of pools bound to a numa node
+typedef struct s_arena
 {
   t_pool pools[HEAP_POOLS]; // tiny, small
-  t_pool large_pool; // every chunk comes from mmap directly
+  int node; // numa node the pools are bound to, -1 if unbound
+} t_arena;
+
+// everything decided once at startup, read-only afterwards
+typedef struct s_heap_config
+{
   size_t page_size;
-  size_t total_allocd;
   struct rlimit limits;
+  uint8_t arena_count; // 1 unless numa is enabled
+  uint8_t arenas_per_node;
+  uint8_t numa_nodes;
+  size_t guard_sample_rate; // 1 in guard_sample_rate allocations get a guard page, 0 if disabled
+  uint64_t secret; // canary key
+  size_t soft_limit; // resident bytes past which free pages go back and callbacks run, 0 if unset
+  size_t hard_limit; // resident bytes allocations can't go past, 0 if unset
+  bool ready; // build_pools is done
   bool enable_asserts;
   bool enable_log_chunk_alloc;
+  bool enable_numa;
+  bool enable_canaries;
+  bool enable_fork_trim; // drop free pages in the child so it doesn't copy-on-write them
+  bool enable_drain; // give the pages of zones that went empty back to the os
+  bool enable_stats; // time every call and path into heap.stats
+  size_t adapt_sample_rate; // 1 in adapt_sample_rate allocations feed the size histogram, 0 if disabled
+  const char* layout_path; // FT_MALLOC_LAYOUT, thresholds loaded at startup and saved at exit
+  size_t reserve_size; // bytes the provisioner keeps mapped ahead, 0 if disabled
+  size_t reserve_region_size;
+  bool reserve_populate; // prefault the reserve with MAP_POPULATE
+  bool numa_nodes_forced; // node count came from FT_MALLOC_NUMA_NODES, map cpus onto them
+} t_heap_config;
+
+// the config gets a page to itself so it can be mprotect'ed once built
+#define HEAP_CONFIG_PAGE_SIZE 4096
+typedef union u_heap_config_page
+{
+  t_heap_config config;
+  char page[HEAP_CONFIG_PAGE_SIZE];
+} t_heap_config_page;
+
+typedef struct s_heap
+{
+  t_arena arenas[HEAP_MAX_ARENAS];
+  t_pool large_pool; // every chunk comes from mmap directly
+  t_pool guarded_pool; // sampled chunks, each on its own mapping followed by a PROT_NONE page
+  uint8_t size_classes[SIZE_CLASS_LOOKUP_SLOTS]; // chunk_size >> SIZE_CLASS_SHIFT -> first pool it fits, HEAP_POOLS if none
+  t_guard_slot guard_quarantine[GUARD_QUARANTINE_SIZE];
+  uint8_t guard_quarantine_head;
+  size_t guard_countdown;
+  uint64_t rng; // xorshift state for the guard sampling
+  size_t total_allocd;
+  size_t resident; // pool pages touched and mappings owned, in bytes
+  size_t pressure_mark; // resident bytes the next pressure event fires at
+  bool pressure_pending; // went past pressure_mark, handled once the lock is released
+  bool in_pressure; // callbacks are running
+  t_pressure_callback pressure_callbacks[PRESSURE_MAX_CALLBACKS];
+  uint64_t stats[STAT_COUNT][STAT_BUCKETS]; // latency histograms, only filled with FT_MALLOC_STATS
+  uint32_t size_samples[SIZE_HIST_BUCKETS]; // sampled chunk sizes, halved after every window
+  uint32_t adapt_samples; // samples since the last threshold update
+  size_t adapt_countdown;
+  size_t adapt_layout[HEAP_POOLS]; // thresholds the last window settled on
+  bool adapt_pending; // adapt_layout waits for a pool to grow
+  bool adapt_due; // a pool grew, the next allocation applies adapt_layout
+  t_reserve_region reserve[RESERVE_MAX_REGIONS];
+  uint8_t reserve_count;
+  size_t reserve_bytes;
+  bool reserve_wanted; // went under the watermark (or had nothing that fit), the provisioner refills it
+  bool provisioner_started;
+  uint64_t epoch; // global epoch for free_deferred
+  t_retire_batch* limbo[3]; // batches retired during each of the last three epochs
+  t_epoch_record epoch_records[EPOCH_MAX_THREADS];
+  bool epoch_full; // a thread found no record left, only reported once
+  bool fork_locked; // the lock was taken by fork_prepare
 } t_heap;
 
 static t_heap heap = {0};
+static t_heap_config_page heap_config __attribute__((aligned(HEAP_CONFIG_PAGE_SIZE))) = {0};
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// set before waiting on the lock, initial-exec so reading it never allocates
+static __thread bool lock_held __attribute__((tls_model("initial-exec"))) = false;
+// arena get_current_arena picked last, and calls left before it picks again
+static __thread uint8_t arena_idx __attribute__((tls_model("initial-exec"))) = 0;
+static __thread uint32_t arena_countdown __attribute__((tls_model("initial-exec"))) = 0;
+// index in heap.epoch_records, -1 until the thread registers
+static __thread int epoch_slot __attribute__((tls_model("initial-exec"))) = -1;
+// what the provisioner thread sleeps on, never held while allocating
+static pthread_mutex_t provision_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t provision_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t epoch_key; // only there so exiting threads unregister
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
 
-#define TINY_POOL (heap.pools[TINY_POOL_IDX])
-#define SMALL_POOL (heap.pools[SMALL_POOL_IDX])
+#define ARENA_POOL(arena, idx) ((arena)->pools[idx])
+#define TINY_POOL(arena) ARENA_POOL(arena, TINY_POOL_IDX)
+#define SMALL_POOL(arena) ARENA_POOL(arena, SMALL_POOL_IDX)
+#define CONFIG (heap_config.config)
 #define LARGE_POOL (heap.large_pool)
+#define GUARDED_POOL (heap.guarded_pool)
 #define IS_LARGE_POOL(pool) (pool->size == 0)
+#define IS_GUARDED_POOL(pool) (pool == &GUARDED_POOL)
+
+// first pool a chunk of chunk_size (header included) fits in, HEAP_POOLS if it's a large one
+static inline uint8_t get_size_class(size_t chunk_size) {
+  if (chunk_size < SIZE_CLASS_LOOKUP_MAX)
+    return heap.size_classes[chunk_size >> SIZE_CLASS_SHIFT];
+  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+    if (chunk_size <= heap.arenas[0].pools[i].max_chunk_size)
+      return i;
+  }
+  return HEAP_POOLS;
+}
 
 
 static size_t align_up_to_power_of_2(size_t size, size_t power);
@@ -100,3 +287,17 @@ static void show_heap(bool dump);
   #define DEBUG_CHUNK(chunk)
   #define DEBUG_POOL(pool)
 #endif
+
+// static probes for perf/bpftrace, a single nop each when nothing is attached, built
+// in whenever <sys/sdt.h> is there unless FT_MALLOC_NO_USDT (make usdt=false)
+#if !defined(FT_MALLOC_NO_USDT) && !defined(FT_MALLOC_USDT) && defined(__has_include)
+  #if __has_include(<sys/sdt.h>)
+    #define FT_MALLOC_USDT
+  #endif
+#endif
+#ifdef FT_MALLOC_USDT
+  #include <sys/sdt.h>
+  #define PROBE(...) STAP_PROBEV(ft_malloc, __VA_ARGS__)
+#else
+  #define PROBE(...)
+#endif
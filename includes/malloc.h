@@ -14,13 +14,54 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <size_classes.h>
 
-void* malloc(size_t size);
-void free(void* ptr);
-void* calloc(size_t nmemb, size_t size);
-void* realloc(void* ptr, size_t size);
-void* reallocarray(void* ptr, size_t nmemb, size_t size);
-void show_alloc_mem(void);
-void show_alloc_mem_ex(void);
-void show_heap(bool dump);
-void draw_heap(void);
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// glibc declares the standard ones noexcept in c++, ours have to agree with them
+#ifdef __cplusplus
+# define FT_MALLOC_NOTHROW noexcept
+#else
+# define FT_MALLOC_NOTHROW
+#endif
+
+void* malloc(size_t size) FT_MALLOC_NOTHROW;
+void free(void* ptr) FT_MALLOC_NOTHROW;
+void* calloc(size_t nmemb, size_t size) FT_MALLOC_NOTHROW;
+void* realloc(void* ptr, size_t size) FT_MALLOC_NOTHROW;
+void* reallocarray(void* ptr, size_t nmemb, size_t size) FT_MALLOC_NOTHROW;
+void* malloc_tiny(size_t size) FT_MALLOC_NOTHROW;
+void* malloc_small(size_t size) FT_MALLOC_NOTHROW;
+void* aligned_alloc(size_t alignment, size_t size) FT_MALLOC_NOTHROW;
+void* memalign(size_t alignment, size_t size) FT_MALLOC_NOTHROW;
+int posix_memalign(void** memptr, size_t alignment, size_t size) FT_MALLOC_NOTHROW;
+void* valloc(size_t size) FT_MALLOC_NOTHROW;
+void free_sized(void* ptr, size_t size) FT_MALLOC_NOTHROW;
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) FT_MALLOC_NOTHROW;
+int malloc_register_pressure_callback(void (*callback)(size_t resident, size_t soft_limit, void* arg), void* arg) FT_MALLOC_NOTHROW;
+int malloc_unregister_pressure_callback(void (*callback)(size_t resident, size_t soft_limit, void* arg), void* arg) FT_MALLOC_NOTHROW;
+int malloc_trim(size_t pad) FT_MALLOC_NOTHROW;
+int malloc_epoch_register(void) FT_MALLOC_NOTHROW;
+void malloc_epoch_unregister(void) FT_MALLOC_NOTHROW;
+int malloc_epoch_enter(void) FT_MALLOC_NOTHROW;
+void malloc_epoch_exit(void) FT_MALLOC_NOTHROW;
+int free_deferred(void* ptr) FT_MALLOC_NOTHROW;
+void malloc_epoch_reclaim(void) FT_MALLOC_NOTHROW;
+int malloc_export_layout(const char* path) FT_MALLOC_NOTHROW;
+void show_alloc_mem(void) FT_MALLOC_NOTHROW;
+void show_alloc_mem_ex(void) FT_MALLOC_NOTHROW;
+void show_alloc_stats(void) FT_MALLOC_NOTHROW;
+void show_heap(bool dump) FT_MALLOC_NOTHROW;
+void draw_heap(void) FT_MALLOC_NOTHROW;
+
+#ifdef __cplusplus
+}
+#endif
+
+// sizes known at compile time go straight to their pool, anything else is a plain malloc
+#define malloc_fast(size) ( \
+  __builtin_constant_p(size) && (size) <= FT_MALLOC_TINY_MAX_SIZE ? malloc_tiny(size) : \
+  __builtin_constant_p(size) && (size) <= FT_MALLOC_SMALL_MAX_SIZE ? malloc_small(size) : \
+  malloc(size))
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a heap inside a MAP_SHARED mapping of fd (a memfd or a regular file),
+// every process that maps it can allocate and free in it, objects are handed
+// across as offsets since each process maps the region at its own address
+typedef struct s_shm_heap t_shm_heap;
+
+t_shm_heap* shm_heap_create(int fd, size_t size);
+t_shm_heap* shm_heap_attach(int fd);
+void shm_heap_detach(t_shm_heap* heap);
+void* shm_malloc(t_shm_heap* heap, size_t size);
+void shm_free(t_shm_heap* heap, void* ptr);
+uint64_t shm_offset(t_shm_heap* heap, void* ptr);
+void* shm_pointer(t_shm_heap* heap, uint64_t offset);
+void shm_heap_set_root(t_shm_heap* heap, void* ptr);
+void* shm_heap_root(t_shm_heap* heap);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,22 @@
+// generated by scripts/gen_size_classes.sh, do not edit
+
+#pragma once
+
+#define TINY_POOL_IDX 0
+#define TINY_POOL_SIZE_MULTIPLIER 128 // * PAGE_SIZE
+#define TINY_POOL_CHUNK_MAX_SIZE_MULTIPLIER(x) (x / 300)
+#define FT_MALLOC_TINY_MAX_SIZE 1712 // biggest request the pool takes with 4096 byte pages
+
+#define SMALL_POOL_IDX 1
+#define SMALL_POOL_SIZE_MULTIPLIER 1024 // * PAGE_SIZE
+#define SMALL_POOL_CHUNK_MAX_SIZE_MULTIPLIER(x) (x / 50)
+#define FT_MALLOC_SMALL_MAX_SIZE 83840 // biggest request the pool takes with 4096 byte pages
+
+#define HEAP_POOLS 2
+#define HEAP_POOL_CLASSES(X) X(TINY) X(SMALL)
+#define POOL_MAX_PAGES 1024 // pages in the biggest pool
+
+// chunk sizes below SIZE_CLASS_LOOKUP_MAX map to a pool with a single table lookup
+#define SIZE_CLASS_SHIFT 4
+#define SIZE_CLASS_LOOKUP_MAX 4096
+#define SIZE_CLASS_LOOKUP_SLOTS (SIZE_CLASS_LOOKUP_MAX >> SIZE_CLASS_SHIFT)
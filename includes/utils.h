@@ -50,6 +50,22 @@ static void* ft_bzero8(void* dst, size_t n) {
   return dst;
 }
 
+// "4096", "512K", "64M", "2G", 0 if it doesn't parse
+static size_t parse_size(const char* str) {
+  size_t size = 0;
+  if (*str < '0' || *str > '9')
+    return 0;
+  while (*str >= '0' && *str <= '9')
+    size = size * 10 + (*str++ - '0');
+  switch (*str) {
+    case 'g': case 'G': size <<= 10; // fallthrough
+    case 'm': case 'M': size <<= 10; // fallthrough
+    case 'k': case 'K': size <<= 10; str++; break;
+    default: break;
+  }
+  return *str ? 0 : size;
+}
+
 #define DUMP_BYTES_PER_LINE 16
 
 static void dump_addr(void* ptr, size_t size) {
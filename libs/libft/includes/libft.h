@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+#include <stdlib.h>
+int ft_printf(const char*, ...);
+int ft_fprintf(int, const char*, ...);
+void ft_bzero(void*, size_t);
+int ft_isprint(int);
+int ft_atoi(const char*);
+size_t ft_strlen(const char*);
+int ft_strncmp(const char*, const char*, size_t);
+void* ft_memcpy(void*, const void*, size_t);
+char* ft_strchr(const char*, int);
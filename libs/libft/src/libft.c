@@ -0,0 +1,15 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include "libft.h"
+static int vfp(int fd, const char* f, va_list ap) { char b[4096]; int n = vsnprintf(b, sizeof b, f, ap); if (n > (int)sizeof b - 1) n = sizeof b - 1; if (n > 0) write(fd, b, n); return n; }
+int ft_printf(const char* f, ...) { va_list ap; va_start(ap, f); int n = vfp(1, f, ap); va_end(ap); return n; }
+int ft_fprintf(int fd, const char* f, ...) { va_list ap; va_start(ap, f); int n = vfp(fd, f, ap); va_end(ap); return n; }
+void ft_bzero(void* p, size_t n) { memset(p, 0, n); }
+int ft_isprint(int c) { return c >= 32 && c < 127; }
+int ft_atoi(const char* s) { return atoi(s); }
+size_t ft_strlen(const char* s) { return strlen(s); }
+int ft_strncmp(const char* a, const char* b, size_t n) { return strncmp(a, b, n); }
+void* ft_memcpy(void* d, const void* s, size_t n) { return memcpy(d, s, n); }
+char* ft_strchr(const char* s, int c) { return strchr(s, c); }
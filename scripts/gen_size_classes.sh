@@ -0,0 +1,54 @@
+#!/bin/sh
+# generates includes/size_classes.h, the pool/size-class table shared by heap.h and malloc.h
+# usage: scripts/gen_size_classes.sh > includes/size_classes.h
+# the output is committed, run it again and commit the header after changing CLASSES
+
+# name pool_size_multiplier(* PAGE_SIZE) max_chunk_size_divisor(pool_size / x)
+CLASSES="
+TINY 128 300
+SMALL 1024 50
+"
+REF_PAGE_SIZE=4096 # smallest page size we expect, the *_MAX_SIZE constants hold for anything bigger
+ALIGNMENT=16
+CHUNK_HEADER_SIZE=32
+LOOKUP_SHIFT=4
+LOOKUP_MAX=4096
+
+cat <<HDR
+// generated by scripts/gen_size_classes.sh, do not edit
+
+#pragma once
+
+HDR
+
+idx=0
+echo "$CLASSES" | while read -r name mult div; do
+  [ -z "$name" ] && continue
+  max_chunk=$(( (mult * REF_PAGE_SIZE / div) / ALIGNMENT * ALIGNMENT ))
+  max_size=$(( max_chunk - CHUNK_HEADER_SIZE ))
+  echo "#define ${name}_POOL_IDX $idx"
+  echo "#define ${name}_POOL_SIZE_MULTIPLIER $mult // * PAGE_SIZE"
+  echo "#define ${name}_POOL_CHUNK_MAX_SIZE_MULTIPLIER(x) (x / $div)"
+  echo "#define FT_MALLOC_${name}_MAX_SIZE $max_size // biggest request the pool takes with ${REF_PAGE_SIZE} byte pages"
+  echo
+  idx=$((idx + 1))
+done
+
+count=0
+list=""
+for name in $(echo "$CLASSES" | awk 'NF { print $1 }'); do
+  list="$list X($name)"
+  count=$((count + 1))
+done
+max_pages=$(echo "$CLASSES" | awk 'NF && $2 > max { max = $2 } END { print max }')
+
+cat <<FTR
+#define HEAP_POOLS $count
+#define HEAP_POOL_CLASSES(X)$list
+#define POOL_MAX_PAGES $max_pages // pages in the biggest pool
+
+// chunk sizes below SIZE_CLASS_LOOKUP_MAX map to a pool with a single table lookup
+#define SIZE_CLASS_SHIFT $LOOKUP_SHIFT
+#define SIZE_CLASS_LOOKUP_MAX $LOOKUP_MAX
+#define SIZE_CLASS_LOOKUP_SLOTS (SIZE_CLASS_LOOKUP_MAX >> SIZE_CLASS_SHIFT)
+FTR
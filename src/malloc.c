@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // getcpu
 #include <stddef.h>
 #include <libft.h>
 #include <heap.h>
@@ -7,9 +8,19 @@
 extern t_heap heap;
 
 static void build_pools(void);
+static inline void init_heap(void);
+static void build_arenas(void);
+static void build_hardening(void);
+static void build_budget(void);
+static bool heap_lock(void);
+static void heap_unlock(void);
+static size_t trim_pool(t_pool* pool);
+static size_t trim_heap(void);
+static t_arena* get_current_arena(void);
+static void numa_bind(void* addr, size_t len, int node);
 static inline size_t get_chunk_size(t_chunk* chunk);
 static inline void* get_chunk_data(t_chunk* chunk);
-static uint8_t init_pool(t_pool* pool);
+static uint8_t init_pool(t_pool* pool, int node);
 static inline size_t get_pool_unmapped_size(t_pool* pool);
 static inline void update_pool_smallest_freed_chunk(t_pool* pool, t_chunk* chunk);
 static t_chunk* build_pool_chunk(t_pool* pool, size_t requested_size);
@@ -21,41 +32,593 @@ static t_chunk* split_pool_chunk(t_pool* pool, t_chunk* chunk, size_t requested_
 static t_chunk* merge_pool_chunks(t_pool* pool, t_chunk* chunk);
 static t_chunk* find_next_unused_chunk(t_pool* pool, t_chunk* chunk, size_t size);
 static t_chunk* alloc_pool_chunk(t_pool* pool, size_t requested_size);
+static t_chunk* alloc_pool_chunk_fast(t_pool* pool, size_t requested_size);
+static t_chunk* take_pool_chunk(t_pool* pool, t_chunk* chunk, size_t requested_size);
 static bool dealloc_pool_chunk(t_pool* pool, t_chunk* chunk);
 static t_chunk* find_pool_chunk_by_data(t_pool* pool, void* ptr, bool large_pool);
 static t_chunk* find_chunk_by_data(void* ptr, t_pool** pool);
 static t_chunk* alloc(size_t size);
+static t_chunk* alloc_class(uint8_t size_class, size_t req_size, t_pool** pool);
+static t_chunk* alloc_aligned(size_t alignment, size_t req_size);
+static void unmap_large_chunk(t_chunk* chunk);
+static void replace_large_pool_chunk(t_pool* pool, t_chunk* chunk, t_chunk* new_chunk);
+static void build_size_classes(void);
+static void build_layout(void);
+static void build_reserve(void);
+static void wake_provisioner(void);
+static void add_resident(size_t bytes);
+static void sub_resident(size_t bytes);
+void malloc_epoch_unregister(void);
+static uint8_t get_zone_shift(size_t pool_size);
 static bool dealloc(void* ptr);
+static bool dealloc_sized(void* ptr, size_t size);
+static t_chunk* find_pool_chunk_by_header(t_pool* pool, void* ptr);
+static bool dealloc_chunk(t_pool* pool, t_chunk* chunk);
+static t_chunk* build_guarded_chunk(t_pool* pool, size_t requested_size);
+static bool dealloc_guarded_chunk(t_pool* pool, t_chunk* chunk);
 static t_chunk* realloc_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_size);
 
 
+// only ever runs once, through init_heap
 static void build_pools(void) {
-  if (heap.page_size)
-    return;
-  heap.enable_asserts = getenv("FT_MALLOC_ASSERT") ? true : false;
-  heap.enable_log_chunk_alloc = getenv("FT_MALLOC_LOG_CHUNK_ALLOC") ? true : false;
-  heap.page_size = getpagesize();
-  if (getrlimit(RLIMIT_AS, &heap.limits) == -1)
-    return;
-  ft_bzero(&heap.pools, sizeof(heap.pools));
-  TINY_POOL.slug = "TINY";
-  TINY_POOL.size = TINY_POOL_SIZE_MULTIPLIER * heap.page_size;
-  TINY_POOL.max_chunk_size = TINY_POOL_CHUNK_MAX_SIZE_MULTIPLIER(TINY_POOL.size);
-  TINY_POOL.max_chunk_size = align_down(TINY_POOL.max_chunk_size);
-  SMALL_POOL.slug = "SMALL";
-  SMALL_POOL.size = SMALL_POOL_SIZE_MULTIPLIER * heap.page_size;
-  SMALL_POOL.max_chunk_size = SMALL_POOL_CHUNK_MAX_SIZE_MULTIPLIER(SMALL_POOL.size);
-  SMALL_POOL.max_chunk_size = align_down(SMALL_POOL.max_chunk_size);
+  CONFIG.enable_asserts = getenv("FT_MALLOC_ASSERT") ? true : false;
+  CONFIG.enable_log_chunk_alloc = getenv("FT_MALLOC_LOG_CHUNK_ALLOC") ? true : false;
+  CONFIG.enable_fork_trim = getenv("FT_MALLOC_FORK_TRIM") ? true : false;
+  CONFIG.enable_drain = getenv("FT_MALLOC_DRAIN") ? true : false;
+  CONFIG.enable_stats = getenv("FT_MALLOC_STATS") ? true : false;
+  CONFIG.page_size = getpagesize();
+  // pthread_once won't run this again, so a failure can't leave the pools unbuilt
+  if (getrlimit(RLIMIT_AS, &CONFIG.limits) == -1) {
+    CONFIG.limits.rlim_cur = RLIM_INFINITY;
+    CONFIG.limits.rlim_max = RLIM_INFINITY;
+  }
+  ft_bzero(&heap.arenas, sizeof(heap.arenas));
+  t_arena* arena = &heap.arenas[0];
+#define BUILD_POOL_CLASS(name) \
+  ARENA_POOL(arena, name##_POOL_IDX).slug = #name; \
+  ARENA_POOL(arena, name##_POOL_IDX).size = name##_POOL_SIZE_MULTIPLIER * CONFIG.page_size; \
+  ARENA_POOL(arena, name##_POOL_IDX).max_chunk_size = name##_POOL_CHUNK_MAX_SIZE_MULTIPLIER(ARENA_POOL(arena, name##_POOL_IDX).size); \
+  ARENA_POOL(arena, name##_POOL_IDX).max_chunk_size = align_down(ARENA_POOL(arena, name##_POOL_IDX).max_chunk_size);
+  HEAP_POOL_CLASSES(BUILD_POOL_CLASS)
+#undef BUILD_POOL_CLASS
   LARGE_POOL.slug = "LARGE";
-  for (uint8_t i = 0; i < HEAP_POOLS + 1; i++) {
+  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
     if (i == 0)
-      heap.pools[i].min_chunk_size = align_up(1) + sizeof(t_chunk);
+      arena->pools[i].min_chunk_size = align_up(1) + sizeof(t_chunk);
+    else
+      arena->pools[i].min_chunk_size = align_up(arena->pools[i - 1].max_chunk_size + 1);
+    arena->pools[i].free_chunks = NULL;
+    arena->pools[i].chunks = NULL;
+    arena->pools[i].last_chunk = NULL;
+    arena->pools[i].zone_shift = get_zone_shift(arena->pools[i].size);
+  }
+  LARGE_POOL.min_chunk_size = align_up(arena->pools[HEAP_POOLS - 1].max_chunk_size + 1);
+  build_size_classes();
+  build_arenas();
+  build_hardening();
+  build_budget();
+  build_layout();
+  build_reserve();
+  // every arena starts as a copy of the first one, only the node changes
+  for (uint8_t i = 1; i < CONFIG.arena_count; i++) {
+    int node = heap.arenas[i].node;
+    heap.arenas[i] = *arena;
+    heap.arenas[i].node = node;
+  }
+}
+
+// smallest page multiple that splits the pool in at most POOL_MAX_ZONES zones
+static uint8_t get_zone_shift(size_t pool_size) {
+  uint8_t shift = __builtin_ctzl(CONFIG.page_size);
+  while (((pool_size - 1) >> shift) + 1 > POOL_MAX_ZONES)
+    shift++;
+  return shift;
+}
+
+// fill the lookup table from the first arena's thresholds, every arena shares them
+static void build_size_classes(void) {
+  for (size_t slot = 0; slot < SIZE_CLASS_LOOKUP_SLOTS; slot++) {
+    size_t chunk_size = slot << SIZE_CLASS_SHIFT;
+    uint8_t size_class = 0;
+    while (size_class < HEAP_POOLS && chunk_size > heap.arenas[0].pools[size_class].max_chunk_size)
+      size_class++;
+    heap.size_classes[slot] = size_class;
+  }
+}
+
+// keeps every threshold above the previous one and every pool able to hold
+// POOL_MIN_CHUNKS of its biggest chunks
+static uint32_t clamp_pool_threshold(uint8_t size_class, size_t max_chunk_size) {
+  size_t min = size_class ? heap.arenas[0].pools[size_class - 1].max_chunk_size + 4 * ALIGNMENT : 8 * ALIGNMENT;
+  size_t max = heap.arenas[0].pools[size_class].size / POOL_MIN_CHUNKS;
+  if (max_chunk_size > max)
+    max_chunk_size = max;
+  if (max_chunk_size < min)
+    max_chunk_size = min;
+  return align_down(max_chunk_size);
+}
+
+// every arena shares the thresholds, the lookup table follows them, chunks
+// already handed out stay where they are (frees and reallocs don't rely on
+// the thresholds to find them)
+static void set_pool_thresholds(size_t* max_chunk_sizes) {
+  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+    uint32_t max_chunk_size = clamp_pool_threshold(i, max_chunk_sizes[i]);
+    for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+      heap.arenas[a].pools[i].max_chunk_size = max_chunk_size;
+      if (i > 0)
+        heap.arenas[a].pools[i].min_chunk_size = align_up(heap.arenas[a].pools[i - 1].max_chunk_size + 1);
+    }
+  }
+  LARGE_POOL.min_chunk_size = align_up(heap.arenas[0].pools[HEAP_POOLS - 1].max_chunk_size + 1);
+  build_size_classes();
+}
+
+// FT_MALLOC_LAYOUT points at lines of "<pool slug> <max chunk size>", as written
+// by malloc_export_layout, read with open/read since stdio would allocate
+static void load_layout(const char* path) {
+  char buf[512];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return;
+  buf[len] = '\0';
+  size_t max_chunk_sizes[HEAP_POOLS];
+  for (uint8_t i = 0; i < HEAP_POOLS; i++)
+    max_chunk_sizes[i] = heap.arenas[0].pools[i].max_chunk_size;
+  char* line = buf;
+  while (*line) {
+    char* end = line;
+    while (*end && *end != '\n')
+      end++;
+    char next = *end;
+    *end = '\0';
+    char* value = line;
+    while (*value && *value != ' ')
+      value++;
+    for (uint8_t i = 0; i < HEAP_POOLS && *value; i++) {
+      size_t max_chunk_size = parse_size(value + 1);
+      if (max_chunk_size && ft_strncmp(line, heap.arenas[0].pools[i].slug, value - line) == 0 && !heap.arenas[0].pools[i].slug[value - line])
+        max_chunk_sizes[i] = max_chunk_size;
+    }
+    line = next ? end + 1 : end;
+  }
+  set_pool_thresholds(max_chunk_sizes);
+}
+
+// FT_MALLOC_ADAPT=N samples 1 in N allocation sizes and moves the pool thresholds
+// to fit them, FT_MALLOC_LAYOUT gives the starting layout and where it's saved
+static void build_layout(void) {
+  char* rate = getenv("FT_MALLOC_ADAPT");
+  CONFIG.adapt_sample_rate = rate && ft_atoi(rate) > 0 ? ft_atoi(rate) : 0;
+  heap.adapt_countdown = CONFIG.adapt_sample_rate;
+  CONFIG.layout_path = getenv("FT_MALLOC_LAYOUT");
+  if (CONFIG.layout_path)
+    load_layout(CONFIG.layout_path);
+}
+
+// log-linear, 4 buckets per power of 2
+static inline uint8_t get_size_bucket(size_t size) {
+  uint8_t log = 63 - __builtin_clzll(size | 4);
+  return (log - 2) * 4 + ((size >> (log - 2)) & 3);
+}
+
+// biggest size falling into bucket
+static inline size_t get_size_bucket_max(uint8_t bucket) {
+  uint8_t log = bucket / 4 + 2;
+  return ((size_t)(4 + bucket % 4 + 1) << (log - 2)) - 1;
+}
+
+// pool i takes the sizes up to the (500 + 500 * (i + 1) / HEAP_POOLS)th permille,
+// the last one everything but the top 0.1%
+static void adapt_pool_thresholds(void) {
+  uint64_t total = 0;
+  for (size_t b = 0; b < SIZE_HIST_BUCKETS; b++)
+    total += heap.size_samples[b];
+  size_t max_chunk_sizes[HEAP_POOLS];
+  uint64_t seen = 0;
+  size_t b = 0;
+  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+    uint64_t permille = 500 + 500 * (i + 1) / HEAP_POOLS;
+    if (permille > 999)
+      permille = 999;
+    while (b < SIZE_HIST_BUCKETS && seen * 1000 < total * permille)
+      seen += heap.size_samples[b++];
+    max_chunk_sizes[i] = get_size_bucket_max(b ? b - 1 : 0);
+  }
+  // shrinking the last pool would only send more requests to mmap
+  if (max_chunk_sizes[HEAP_POOLS - 1] < heap.arenas[0].pools[HEAP_POOLS - 1].max_chunk_size)
+    max_chunk_sizes[HEAP_POOLS - 1] = heap.arenas[0].pools[HEAP_POOLS - 1].max_chunk_size;
+  for (uint8_t i = 0; i < HEAP_POOLS; i++)
+    heap.adapt_layout[i] = max_chunk_sizes[i];
+  heap.adapt_pending = true;
+  // older samples fade out so the layout follows the workload
+  for (size_t i = 0; i < SIZE_HIST_BUCKETS; i++)
+    heap.size_samples[i] /= 2;
+  heap.adapt_samples = 0;
+}
+
+static inline void sample_chunk_size(size_t chunk_size) {
+  if (!CONFIG.adapt_sample_rate)
+    return;
+  // a new layout waits for the heap to grow, a workload in steady state keeps
+  // its pools as they are
+  if (heap.adapt_due) {
+    set_pool_thresholds(heap.adapt_layout);
+    heap.adapt_pending = false;
+    heap.adapt_due = false;
+  }
+  if (--heap.adapt_countdown > 0)
+    return;
+  heap.adapt_countdown = CONFIG.adapt_sample_rate;
+  heap.size_samples[get_size_bucket(chunk_size)]++;
+  if (++heap.adapt_samples >= ADAPT_WINDOW)
+    adapt_pool_thresholds();
+}
+
+// reads the highest possible node from sysfs ("0" or "0-3")
+static uint8_t read_numa_node_count(void) {
+  char buf[32];
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 1;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 1;
+  buf[len] = '\0';
+  size_t last = 0;
+  for (ssize_t i = 0; i < len; i++) {
+    if (buf[i] >= '0' && buf[i] <= '9')
+      last = last * 10 + (buf[i] - '0');
+    else if (buf[i] == '-' || buf[i] == ',')
+      last = 0;
     else
-      heap.pools[i].min_chunk_size = align_up(heap.pools[i - 1].max_chunk_size + 1);
-    heap.pools[i].free_chunks = NULL;
-    heap.pools[i].chunks = NULL;
-    heap.pools[i].last_chunk = NULL;
+      break;
   }
+  if (last + 1 > NUMA_MAX_NODES)
+    return NUMA_MAX_NODES;
+  return last + 1;
+}
+
+// FT_MALLOC_NUMA enables one arena per node (or FT_MALLOC_NUMA_ARENAS_PER_NODE),
+// FT_MALLOC_NUMA_NODES fakes the node count so it can be exercised on a single node box
+static void build_arenas(void) {
+  CONFIG.arena_count = 1;
+  CONFIG.arenas_per_node = 1;
+  CONFIG.numa_nodes = 1;
+  heap.arenas[0].node = -1;
+  char* forced_nodes = getenv("FT_MALLOC_NUMA_NODES");
+  CONFIG.enable_numa = getenv("FT_MALLOC_NUMA") || forced_nodes;
+  if (!CONFIG.enable_numa)
+    return;
+  CONFIG.numa_nodes_forced = forced_nodes != NULL;
+  int nodes = CONFIG.numa_nodes_forced ? ft_atoi(forced_nodes) : read_numa_node_count();
+  if (nodes < 1)
+    nodes = 1;
+  if (nodes > NUMA_MAX_NODES)
+    nodes = NUMA_MAX_NODES;
+  char* per_node_env = getenv("FT_MALLOC_NUMA_ARENAS_PER_NODE");
+  int per_node = per_node_env ? ft_atoi(per_node_env) : 1;
+  if (per_node < 1)
+    per_node = 1;
+  if (per_node * nodes > HEAP_MAX_ARENAS)
+    per_node = HEAP_MAX_ARENAS / nodes > 0 ? HEAP_MAX_ARENAS / nodes : 1;
+  CONFIG.numa_nodes = nodes;
+  CONFIG.arenas_per_node = per_node;
+  CONFIG.arena_count = per_node * nodes > HEAP_MAX_ARENAS ? HEAP_MAX_ARENAS : per_node * nodes;
+  for (uint8_t i = 0; i < CONFIG.arena_count; i++)
+    heap.arenas[i].node = i / per_node;
+}
+
+// picks the arena of the node the calling thread is running on
+// with more nodes than arenas, the extra nodes share arenas with the first ones
+// the pick is cached per thread and only refreshed every ARENA_REFRESH calls,
+// getcpu goes through the vdso where there's one but is a real syscall elsewhere
+// arenas only buy locality, every one of them is still behind the heap lock
+static t_arena* get_current_arena(void) {
+  if (CONFIG.arena_count <= 1)
+    return &heap.arenas[0];
+  if (arena_countdown-- > 0)
+    return &heap.arenas[arena_idx];
+  arena_countdown = ARENA_REFRESH;
+  unsigned int cpu = 0;
+  unsigned int node = 0;
+  if (getcpu(&cpu, &node) == -1)
+    return &heap.arenas[arena_idx];
+  if (CONFIG.numa_nodes_forced)
+    node = cpu % CONFIG.numa_nodes;
+  size_t idx = node * CONFIG.arenas_per_node + cpu % CONFIG.arenas_per_node;
+  arena_idx = idx % CONFIG.arena_count;
+  return &heap.arenas[arena_idx];
+}
+
+// prefer the given node for the range, if the node doesn't exist (or the kernel
+// has no numa support) mbind fails and the memory stays wherever the kernel puts it
+static void numa_bind(void* addr, size_t len, int node) {
+  if (node < 0 || !CONFIG.enable_numa)
+    return;
+  unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  // the kernel only reads maxnode - 1 bits
+  syscall(SYS_mbind, addr, len, NUMA_MPOL_PREFERRED, mask, NUMA_MAX_NODES + 1, 0);
+}
+
+// 0 unless FT_MALLOC_STATS is set, so the disabled path never reads the clock
+static inline uint64_t stat_clock(void) {
+  if (!CONFIG.enable_stats)
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the lock has to be held, start comes from stat_clock
+static inline void record_stat(t_stat stat, uint64_t start) {
+  if (!CONFIG.enable_stats)
+    return;
+  uint64_t ns = start ? stat_clock() - start : 0;
+  uint8_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= STAT_BUCKETS)
+    bucket = STAT_BUCKETS - 1;
+  heap.stats[stat][bucket]++;
+}
+
+// FT_MALLOC_RESERVE=<size> keeps about that much mapped ahead by a background
+// thread, refilled once it drops under half, FT_MALLOC_RESERVE_POPULATE also
+// prefaults it, left off with numa since the pages would land on the
+// provisioner's node before the arena could bind them
+static void build_reserve(void) {
+  char* reserve = getenv("FT_MALLOC_RESERVE");
+  CONFIG.reserve_size = reserve && !CONFIG.enable_numa ? parse_size(reserve) : 0;
+  CONFIG.reserve_region_size = align_up_to_power_of_2(CONFIG.reserve_size / RESERVE_REGIONS, CONFIG.page_size);
+  CONFIG.reserve_populate = getenv("FT_MALLOC_RESERVE_POPULATE") ? true : false;
+  heap.reserve_wanted = CONFIG.reserve_size != 0;
+}
+
+// best fit from the reserve, whatever is left of the region stays in it
+static void* take_reserve(size_t len) {
+  if (!CONFIG.reserve_size)
+    return NULL;
+  len = align_up_to_power_of_2(len, CONFIG.page_size);
+  t_reserve_region* best = NULL;
+  for (uint8_t i = 0; i < heap.reserve_count; i++) {
+    t_reserve_region* region = &heap.reserve[i];
+    if (region->len >= len && (!best || region->len < best->len))
+      best = region;
+  }
+  if (!best) {
+    if (len <= CONFIG.reserve_region_size)
+      __atomic_store_n(&heap.reserve_wanted, true, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  void* addr = best->addr;
+  best->addr += len;
+  best->len -= len;
+  if (!best->len)
+    *best = heap.reserve[--heap.reserve_count];
+  heap.reserve_bytes -= len;
+  // prefaulted pages leave the reserve's count, the caller counts them again
+  if (CONFIG.reserve_populate)
+    sub_resident(len);
+  if (heap.reserve_bytes < CONFIG.reserve_size / 2)
+    __atomic_store_n(&heap.reserve_wanted, true, __ATOMIC_RELAXED);
+  PROBE(reserve__take, addr, len);
+  return addr;
+}
+
+// prefaulted regions are resident, they only get mapped while they fit under
+// the soft limit (the hard one without it), the lock has to be held
+static bool reserve_fits(void) {
+  size_t limit = CONFIG.soft_limit ? CONFIG.soft_limit : CONFIG.hard_limit;
+  return !CONFIG.reserve_populate || !limit || heap.resident + CONFIG.reserve_region_size <= limit;
+}
+
+// trimming gives a prefaulted reserve back, the heap needs the room more
+static size_t drop_reserve(void) {
+  if (!CONFIG.reserve_populate)
+    return 0;
+  size_t released = heap.reserve_bytes;
+  for (uint8_t i = 0; i < heap.reserve_count; i++)
+    munmap(heap.reserve[i].addr, heap.reserve[i].len);
+  heap.reserve_count = 0;
+  heap.reserve_bytes = 0;
+  sub_resident(released);
+  return released;
+}
+
+// maps outside the lock, only takes it to add the region, at least one region
+// per wake up so a reserve full of leftovers too small to use still gets one
+static void refill_reserve(void) {
+  int flags = MAP_ANONYMOUS | MAP_PRIVATE | (CONFIG.reserve_populate ? MAP_POPULATE : 0);
+  for (bool first = true;; first = false) {
+    if (!heap_lock())
+      return;
+    bool full = heap.reserve_bytes >= CONFIG.reserve_size;
+    bool fits = reserve_fits();
+    heap_unlock();
+    if ((full && !first) || !fits)
+      return;
+    void* addr = mmap(NULL, CONFIG.reserve_region_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (addr == MAP_FAILED)
+      return;
+    PROBE(reserve__refill, addr, CONFIG.reserve_region_size);
+    t_reserve_region dropped = {NULL, 0};
+    heap_lock();
+    // the heap grew while the region was being mapped
+    if (!reserve_fits()) {
+      heap_unlock();
+      munmap(addr, CONFIG.reserve_region_size);
+      return;
+    }
+    if (heap.reserve_count == RESERVE_MAX_REGIONS) {
+      // the smallest leftover makes room
+      uint8_t smallest = 0;
+      for (uint8_t i = 1; i < heap.reserve_count; i++) {
+        if (heap.reserve[i].len < heap.reserve[smallest].len)
+          smallest = i;
+      }
+      dropped = heap.reserve[smallest];
+      heap.reserve_bytes -= dropped.len;
+      if (CONFIG.reserve_populate)
+        sub_resident(dropped.len);
+      heap.reserve[smallest] = heap.reserve[--heap.reserve_count];
+    }
+    heap.reserve[heap.reserve_count].addr = addr;
+    heap.reserve[heap.reserve_count].len = CONFIG.reserve_region_size;
+    heap.reserve_count++;
+    heap.reserve_bytes += CONFIG.reserve_region_size;
+    if (CONFIG.reserve_populate)
+      add_resident(CONFIG.reserve_region_size);
+    heap_unlock();
+    if (dropped.addr)
+      munmap(dropped.addr, dropped.len);
+  }
+}
+
+static void* provisioner(void* arg) {
+  (void)arg;
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  for (;;) {
+    pthread_mutex_lock(&provision_lock);
+    while (!__atomic_load_n(&heap.reserve_wanted, __ATOMIC_RELAXED))
+      pthread_cond_wait(&provision_cond, &provision_lock);
+    __atomic_store_n(&heap.reserve_wanted, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&provision_lock);
+    refill_reserve();
+  }
+  return NULL;
+}
+
+// called without the heap lock, the thread is started on first use (and again
+// in a forked child), pthread_create may allocate so it runs outside every lock
+static void wake_provisioner(void) {
+  if (!__atomic_load_n(&heap.reserve_wanted, __ATOMIC_RELAXED) || lock_held)
+    return;
+  if (!__atomic_exchange_n(&heap.provisioner_started, true, __ATOMIC_ACQ_REL)) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, provisioner, NULL) != 0)
+      __atomic_store_n(&heap.provisioner_started, false, __ATOMIC_RELEASE);
+    pthread_attr_destroy(&attr);
+  }
+  // a signal handler allocating in here fails in heap_lock instead of deadlocking
+  lock_held = true;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&provision_lock);
+  pthread_cond_signal(&provision_cond);
+  pthread_mutex_unlock(&provision_lock);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  lock_held = false;
+}
+
+// every mapping goes through these so it can be timed and traced
+static void* map_new_pages(size_t len) {
+  uint64_t start = stat_clock();
+  void* addr = mmap(NULL, len, MMAP_FLAGS);
+  record_stat(STAT_MMAP, start);
+  PROBE(mmap, addr, len);
+  return addr;
+}
+
+static void* map_pages(size_t len) {
+  void* reserved = take_reserve(len);
+  return reserved ? reserved : map_new_pages(len);
+}
+
+static int unmap_pages(void* addr, size_t len) {
+  uint64_t start = stat_clock();
+  int ret = munmap(addr, len);
+  record_stat(STAT_MUNMAP, start);
+  PROBE(munmap, addr, len);
+  return ret;
+}
+
+// a signal handler allocating while its own thread is inside the allocator
+// would deadlock on the lock, so that nested call fails instead
+static bool heap_lock(void) {
+  if (lock_held)
+    return false;
+  lock_held = true;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  if (pthread_mutex_trylock(&lock) == 0) {
+    record_stat(STAT_LOCK_WAIT, 0);
+    return true;
+  }
+  PROBE(lock__wait);
+  uint64_t start = stat_clock();
+  pthread_mutex_lock(&lock);
+  record_stat(STAT_LOCK_WAIT, start);
+  PROBE(lock__acquired);
+  return true;
+}
+
+static void heap_unlock(void) {
+  pthread_mutex_unlock(&lock);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  lock_held = false;
+}
+
+// hold the lock across fork so the child never sees a pool half way through an update
+static void fork_prepare(void) {
+  heap.fork_locked = heap_lock();
+}
+
+static void fork_parent(void) {
+  if (heap.fork_locked)
+    heap_unlock();
+}
+
+// the forking thread is the only one left, so the lock can just be recreated
+static void fork_child(void) {
+  pthread_mutex_init(&lock, NULL);
+  lock_held = false;
+  heap.fork_locked = false;
+  heap.in_pressure = false;
+  // the provisioner didn't follow, the next allocation wanting it starts a new one
+  pthread_mutex_init(&provision_lock, NULL);
+  pthread_cond_init(&provision_cond, NULL);
+  heap.provisioner_started = false;
+  // the other threads are gone, they can't hold the epoch back anymore
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    if (i != epoch_slot) {
+      heap.epoch_records[i].registered = false;
+      heap.epoch_records[i].state = 0;
+    }
+  }
+  if (CONFIG.enable_fork_trim)
+    trim_heap();
+}
+
+static void build_heap(void) {
+  build_pools();
+  __atomic_store_n(&CONFIG.ready, true, __ATOMIC_RELEASE);
+  // nothing writes the config past this point, keep it that way
+  if (CONFIG.page_size == HEAP_CONFIG_PAGE_SIZE)
+    mprotect(&heap_config, sizeof(heap_config), PROT_READ);
+}
+
+// getenv/getrlimit and friends run once, outside the lock
+static inline void init_heap(void) {
+  if (__atomic_load_n(&CONFIG.ready, __ATOMIC_ACQUIRE))
+    return;
+  pthread_once(&heap_once, build_heap);
+}
+
+// anything allocating before constructors run still goes through pthread_once,
+// the fork handlers are registered here rather than in build_pools since pthread_atfork may allocate
+__attribute__((constructor))
+static void heap_constructor(void) {
+  init_heap();
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+  wake_provisioner();
 }
 
 static inline size_t get_chunk_size(t_chunk* chunk) {
@@ -66,12 +629,99 @@ static inline void* get_chunk_data(t_chunk* chunk) {
   return (void*)chunk + sizeof(t_chunk);
 }
 
-#define ASSERT(...) { if (heap.enable_asserts) assert(__VA_ARGS__); }
+// FT_MALLOC_HARDEN seals every chunk header handed out and checks it (and for
+// double frees) on free/realloc, FT_MALLOC_GUARD_SAMPLE=N puts 1 in N allocations
+// on their own mapping, right before a PROT_NONE page
+static void build_hardening(void) {
+  CONFIG.enable_canaries = getenv("FT_MALLOC_HARDEN") ? true : false;
+  char* sample = getenv("FT_MALLOC_GUARD_SAMPLE");
+  int rate = sample ? ft_atoi(sample) : 0;
+  CONFIG.guard_sample_rate = rate > 0 ? rate : 0;
+  GUARDED_POOL.slug = "GUARDED";
+  if (!CONFIG.enable_canaries && !CONFIG.guard_sample_rate)
+    return;
+  uint64_t* random = (uint64_t*)getauxval(AT_RANDOM);
+  CONFIG.secret = random ? random[0] : (uintptr_t)&heap;
+  heap.rng = (random ? random[1] : (uintptr_t)&heap) | 1;
+  heap.guard_countdown = CONFIG.guard_sample_rate;
+}
+
+static inline uint64_t next_random(void) {
+  heap.rng ^= heap.rng << 13;
+  heap.rng ^= heap.rng >> 7;
+  heap.rng ^= heap.rng << 17;
+  return heap.rng;
+}
+
+static void heap_abort(const char* reason, void* ptr) {
+  ft_fprintf(2, "ft_malloc: %s (%p)\n", reason, ptr);
+  abort();
+}
+
+// covers the links too, free follows them right after the check
+static inline uint32_t get_chunk_canary(t_chunk* chunk) {
+  uint64_t x = ((uintptr_t)chunk ^ chunk->size) * 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (uintptr_t)chunk->next) * 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (uintptr_t)chunk->prev) * 0x9e3779b97f4a7c15ULL;
+  x ^= CONFIG.secret;
+  return (uint32_t)(x ^ (x >> 32));
+}
+
+// free chunks are left alone, so it can be called on any neighbour whose links just changed
+static inline void seal_chunk(t_chunk* chunk) {
+  if (chunk && chunk->used && CONFIG.enable_canaries)
+    chunk->canary = get_chunk_canary(chunk);
+}
+
+// the chunk is about to be freed or resized, make sure the header is still ours
+static inline void check_chunk(t_chunk* chunk, void* ptr) {
+  if (!CONFIG.enable_canaries)
+    return;
+  if (!chunk->used)
+    heap_abort("double free", ptr);
+  if (chunk->canary != get_chunk_canary(chunk))
+    heap_abort("corrupted chunk header", ptr);
+}
+
+static inline void poison_chunk(t_chunk* chunk) {
+  if (CONFIG.enable_canaries)
+    chunk->canary = get_chunk_canary(chunk) ^ CHUNK_FREED_POISON;
+}
+
+// the pointer isn't a live chunk, tell what it was if we can
+static void check_unknown_ptr(void* ptr) {
+  if (!CONFIG.enable_canaries && !CONFIG.guard_sample_rate)
+    return;
+  for (uint8_t i = 0; i < GUARD_QUARANTINE_SIZE; i++) {
+    if (heap.guard_quarantine[i].data == ptr)
+      heap_abort("double free", ptr);
+  }
+  if (!CONFIG.enable_canaries)
+    return;
+  for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+    for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+      t_pool* pool = &heap.arenas[a].pools[i];
+      if (pool->data && ptr >= pool->data && ptr < pool->data + pool->size)
+        heap_abort("invalid pointer or double free", ptr);
+    }
+  }
+}
+
+static inline bool should_guard_chunk(size_t chunk_size) {
+  if (!CONFIG.guard_sample_rate || chunk_size >= LARGE_POOL.min_chunk_size)
+    return false;
+  if (--heap.guard_countdown > 0)
+    return false;
+  heap.guard_countdown = 1 + next_random() % (CONFIG.guard_sample_rate * 2);
+  return true;
+}
+
+#define ASSERT(...) { if (CONFIG.enable_asserts) assert(__VA_ARGS__); }
 static inline void assert_chunk_data(t_chunk* chunk) {
-  if (!chunk || !heap.enable_asserts)
+  if (!chunk || !CONFIG.enable_asserts)
     return;
   ASSERT(chunk->size > 0 && "assert_chunk_data: chunk size is 0");
-  ASSERT(chunk->size < heap.limits.rlim_cur && "assert_chunk_data: chunk size is too large");
+  ASSERT(chunk->size < CONFIG.limits.rlim_cur && "assert_chunk_data: chunk size is too large");
   ASSERT(chunk->size % 16 == 0 && "assert_chunk_data: chunk size is not aligned");
   ASSERT(chunk->size % 8 == 0 && "assert_chunk_data: chunk size is not aligned");
   ASSERT(get_chunk_size(chunk) % 16 == 0 && "assert_chunk_data: chunk total size is not aligned");
@@ -80,16 +730,218 @@ static inline void assert_chunk_data(t_chunk* chunk) {
     ASSERT((void*)chunk + get_chunk_size(chunk) == (void*)chunk->next && "assert_chunk_size: chunk size is incorrect");
 }
 
-static uint8_t init_pool(t_pool* pool) {
+static uint8_t init_pool(t_pool* pool, int node) {
   if (pool->data || pool->size == 0)
     return true;
-  pool->data = mmap(NULL, pool->size, MMAP_FLAGS);
-  if (pool->data == MAP_FAILED)
+  void* reserved = take_reserve(pool->size);
+  pool->data = reserved ? reserved : map_new_pages(pool->size);
+  if (pool->data == MAP_FAILED) {
+    pool->data = NULL;
     return false;
+  }
+  // bind before anything touches the pages, so they fault in on the right node
+  numa_bind(pool->data, pool->size, node);
   pool->unmapped = pool->data;
+  pool->touched = pool->data;
+  // a prefaulted region is resident already, the pool counts all of it up front
+  if (reserved && CONFIG.reserve_populate) {
+    add_resident(pool->size);
+    pool->touched = pool->data + pool->size;
+  }
+  return true;
+}
+
+// FT_MALLOC_HARD_LIMIT caps the bytes the heap keeps resident, FT_MALLOC_SOFT_LIMIT
+// (7/8 of the hard one unless set) is where it starts giving pages back
+static void build_budget(void) {
+  char* hard = getenv("FT_MALLOC_HARD_LIMIT");
+  char* soft = getenv("FT_MALLOC_SOFT_LIMIT");
+  CONFIG.hard_limit = hard ? parse_size(hard) : 0;
+  CONFIG.soft_limit = soft ? parse_size(soft) : CONFIG.hard_limit / 8 * 7;
+  if (CONFIG.hard_limit && CONFIG.soft_limit > CONFIG.hard_limit)
+    CONFIG.soft_limit = CONFIG.hard_limit;
+  heap.pressure_mark = CONFIG.soft_limit;
+}
+
+static void add_resident(size_t bytes) {
+  heap.resident += bytes;
+  if (CONFIG.soft_limit && heap.resident >= heap.pressure_mark)
+    __atomic_store_n(&heap.pressure_pending, true, __ATOMIC_RELAXED);
+}
+
+static void sub_resident(size_t bytes) {
+  heap.resident -= bytes;
+  if (heap.resident < CONFIG.soft_limit)
+    heap.pressure_mark = CONFIG.soft_limit;
+}
+
+// can the heap take bytes more, trims everything once before saying no
+static bool within_budget(size_t bytes) {
+  if (!CONFIG.hard_limit || heap.resident + bytes <= CONFIG.hard_limit)
+    return true;
+  trim_heap();
+  if (heap.resident + bytes <= CONFIG.hard_limit)
+    return true;
+  if (CONFIG.soft_limit)
+    __atomic_store_n(&heap.pressure_pending, true, __ATOMIC_RELAXED);
+  return false;
+}
+
+// the pool is about to be written up to end, the pages in between become resident
+static bool touch_pool(t_pool* pool, void* end) {
+  void* touched = (void*)align_up_to_power_of_2((uintptr_t)end, CONFIG.page_size);
+  if (touched > pool->data + pool->size)
+    touched = pool->data + pool->size;
+  if (touched <= pool->touched)
+    return true;
+  if (!within_budget(touched - pool->touched))
+    return false;
+  // trimming may have moved pool->touched back
+  add_resident(touched - pool->touched);
+  pool->touched = touched;
+  heap.adapt_due = heap.adapt_pending;
+  return true;
+}
+
+// flips the purged bit of the pages of [start, end) to purged, returns the
+// bytes of the pages that actually changed
+static size_t mark_purged(t_pool* pool, void* start, void* end, bool purged) {
+  size_t changed = 0;
+  size_t last = (end - pool->data) / CONFIG.page_size;
+  for (size_t page = (start - pool->data) / CONFIG.page_size; page < last; page++) {
+    uint64_t bit = 1ULL << (page % 64);
+    if (!(pool->purged[page / 64] & bit) == !purged)
+      continue;
+    pool->purged[page / 64] ^= bit;
+    changed += CONFIG.page_size;
+  }
+  pool->purged_bytes += purged ? changed : -changed;
+  return changed;
+}
+
+// page aligned [start, end) goes back to the os, returns how many bytes stopped being resident
+static size_t purge_pages(t_pool* pool, void* start, void* end) {
+  if (end <= start || madvise(start, end - start, MADV_DONTNEED) == -1)
+    return 0;
+  size_t released = mark_purged(pool, start, end, true);
+  sub_resident(released);
+  return released;
+}
+
+// give the pages fully inside a free chunk back to the os, the header stays
+static size_t purge_chunk(t_pool* pool, t_chunk* chunk) {
+  void* data = get_chunk_data(chunk);
+  void* start = (void*)align_up_to_power_of_2((uintptr_t)data, CONFIG.page_size);
+  void* end = (void*)align_down_to_power_of_2((uintptr_t)data + chunk->size, CONFIG.page_size);
+  return purge_pages(pool, start, end);
+}
+
+// end of what taking a free chunk up to end writes, a split leaves the rest untouched
+static inline void* get_reused_end(t_chunk* chunk, void* end) {
+  void* chunk_end = (void*)chunk + get_chunk_size(chunk);
+  return end < chunk_end ? end : chunk_end;
+}
+
+// [start, end) is about to be written, the purged pages in it count as resident again
+static bool reuse_pages(t_pool* pool, void* start, void* end) {
+  if (!pool->purged_bytes)
+    return true;
+  start = (void*)align_down_to_power_of_2((uintptr_t)start, CONFIG.page_size);
+  end = (void*)align_up_to_power_of_2((uintptr_t)end, CONFIG.page_size);
+  size_t bytes = 0;
+  for (size_t page = (start - pool->data) / CONFIG.page_size; page < (size_t)(end - pool->data) / CONFIG.page_size; page++)
+    bytes += pool->purged[page / 64] & (1ULL << (page % 64)) ? CONFIG.page_size : 0;
+  if (!bytes)
+    return true;
+  if (!within_budget(bytes))
+    return false;
+  // trimming may have purged more of the range
+  add_resident(mark_purged(pool, start, end, false));
   return true;
 }
 
+// drop every page of the pool that holds no used chunk, returns how many bytes went back
+static size_t trim_pool(t_pool* pool) {
+  if (!pool->data)
+    return 0;
+  size_t released = 0;
+  for (t_chunk* chunk = pool->chunks; chunk; chunk = chunk->next) {
+    if (!chunk->used)
+      released += purge_chunk(pool, chunk);
+  }
+  // the tail may hold pages purged back when they were inside a free chunk,
+  // they aren't resident anymore and past touched they don't need a bit
+  void* tail = (void*)align_up_to_power_of_2((uintptr_t)pool->unmapped, CONFIG.page_size);
+  if (tail < pool->touched && madvise(tail, pool->touched - tail, MADV_DONTNEED) == 0) {
+    size_t bytes = pool->touched - tail - mark_purged(pool, tail, pool->touched, false);
+    released += bytes;
+    sub_resident(bytes);
+    pool->touched = tail;
+  }
+  return released;
+}
+
+static size_t trim_heap(void) {
+  size_t released = drop_reserve();
+  for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+    for (uint8_t i = 0; i < HEAP_POOLS; i++)
+      released += trim_pool(&heap.arenas[a].pools[i]);
+  }
+  return released;
+}
+
+// add a used chunk to the zones it covers, or take it back out, only
+// FT_MALLOC_DRAIN reads the zones so the default path doesn't pay for them
+static void count_chunk(t_pool* pool, t_chunk* chunk, bool used) {
+  if (IS_LARGE_POOL(pool) || !CONFIG.enable_drain)
+    return;
+  size_t start = (void*)chunk - pool->data;
+  size_t end = start + get_chunk_size(chunk);
+  while (start < end) {
+    size_t zone = start >> pool->zone_shift;
+    size_t zone_end = (zone + 1) << pool->zone_shift;
+    size_t bytes = (end < zone_end ? end : zone_end) - start;
+    if (used) {
+      pool->zone_used[zone] += bytes;
+      pool->drain_pending &= ~(1ULL << zone);
+    }
+    else {
+      pool->zone_used[zone] -= bytes;
+      if (!pool->zone_used[zone])
+        pool->drain_pending |= 1ULL << zone;
+    }
+    start += bytes;
+  }
+}
+
+static inline uint32_t get_zone_used(t_pool* pool, t_chunk* chunk) {
+  return pool->zone_used[((void*)chunk - pool->data) >> pool->zone_shift];
+}
+
+// the zones that went empty hold only free chunks, give their pages back
+// (headers stay), a zone flipping between empty and used only counts once
+static void drain_pool(t_pool* pool) {
+  if (__builtin_popcountll(pool->drain_pending) < ZONE_DRAIN_BATCH)
+    return;
+  uint64_t pending = pool->drain_pending;
+  pool->drain_pending = 0;
+  for (t_chunk* chunk = pool->chunks; chunk; chunk = chunk->next) {
+    if (chunk->used)
+      continue;
+    void* data = get_chunk_data(chunk);
+    void* start = (void*)align_up_to_power_of_2((uintptr_t)data, CONFIG.page_size);
+    void* end = (void*)align_down_to_power_of_2((uintptr_t)data + chunk->size, CONFIG.page_size);
+    while (start < end) {
+      size_t zone = (start - pool->data) >> pool->zone_shift;
+      void* zone_end = pool->data + ((zone + 1) << pool->zone_shift);
+      void* stop = end < zone_end ? end : zone_end;
+      if (pending & (1ULL << zone))
+        purge_pages(pool, start, stop);
+      start = stop;
+    }
+  }
+}
+
 static inline size_t get_pool_unmapped_size(t_pool* pool) {
   return pool->data + pool->size - pool->unmapped < 0 ? 0 : pool->data + pool->size - pool->unmapped;
 }
@@ -108,6 +960,8 @@ static t_chunk* build_pool_chunk(t_pool* pool, size_t requested_size) {
   ASSERT(chunk_size <= pool->max_chunk_size && "build_pool_chunk: chunk_size > pool->max_chunk_size");
   if (get_pool_unmapped_size(pool) < chunk_size)
     return NULL;
+  if (!reuse_pages(pool, pool->unmapped, pool->unmapped + chunk_size) || !touch_pool(pool, pool->unmapped + chunk_size))
+    return NULL;
   t_chunk* chunk = pool->unmapped;
   ft_bzero8(chunk, sizeof(t_chunk));
   chunk->size = data_size;
@@ -118,12 +972,15 @@ static t_chunk* build_pool_chunk(t_pool* pool, size_t requested_size) {
   DEBUG_CHUNK(chunk);
   if (!pool->chunks)
     pool->chunks = chunk;
-  else
+  else {
     pool->last_chunk->next = chunk;
+    seal_chunk(pool->last_chunk);
+  }
   pool->last_chunk = chunk;
   pool->unmapped = (void*)chunk + chunk_size;
   if (pool->unmapped > pool->data + pool->size)
     pool->unmapped = pool->data + pool->size;
+  count_chunk(pool, chunk, true);
   DEBUG_POOL(pool);
   ASSERT(pool->unmapped <= pool->data + pool->size && "build_pool_chunk: pool->unmapped is out of bounds");
   assert_chunk_data(chunk);
@@ -134,42 +991,68 @@ static inline void merge_two_chunks(t_pool* pool, t_chunk* a, t_chunk* b) {
   ASSERT(a->next == b && b->prev == a && "merge_two_chunks: chunks are not adjacent");
   a->size += get_chunk_size(b);
   a->next = b->next;
-  if (b->next)
+  if (b->next) {
     b->next->prev = a;
+    seal_chunk(b->next);
+  }
   if (pool->last_chunk == b)
     pool->last_chunk = a;
+  // growing a used chunk into a free one must not leave it tracked as free
   if (pool->free_chunks == b)
-    pool->free_chunks = a;
+    pool->free_chunks = a->used ? NULL : a;
   assert_chunk_data(a);
   assert_chunk_data(b);
 }
 
 static t_chunk* grow_large_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_size) {
   ASSERT(IS_LARGE_POOL(pool) && "grow_large_pool_chunk: pool is not large");
-  size_t new_size = align_up_to_power_of_2(align_up(new_req_size) + sizeof(t_chunk), heap.page_size);
+  size_t new_size = align_up_to_power_of_2(align_up(new_req_size) + sizeof(t_chunk), CONFIG.page_size);
   size_t new_chunk_size = new_size + sizeof(t_chunk);
   DEBUG_LOG("grow_large_pool_chunk: pool %s[%p], chunk %p, new_req_size %u, new_chunk_size: %u\n", pool->slug, pool, chunk, new_req_size, new_chunk_size);
-  t_chunk* new_chunk = mmap(NULL, new_chunk_size, MMAP_FLAGS);
+  size_t mapped_size = align_up_to_power_of_2(new_chunk_size, CONFIG.page_size);
+  if (!within_budget(mapped_size))
+    return NULL;
+  t_chunk* new_chunk = map_pages(new_chunk_size);
   if (new_chunk == MAP_FAILED)
     return NULL;
+  add_resident(mapped_size);
+  numa_bind(new_chunk, new_chunk_size, get_current_arena()->node);
   ft_bzero8(new_chunk, sizeof(t_chunk));
   new_chunk->size = new_size;
+  replace_large_pool_chunk(pool, chunk, new_chunk);
+  ft_memmove8(get_chunk_data(new_chunk), get_chunk_data(chunk), chunk->size);
+  unmap_large_chunk(chunk);
+  return new_chunk;
+}
+
+// new_chunk takes chunk's place in the list
+static void replace_large_pool_chunk(t_pool* pool, t_chunk* chunk, t_chunk* new_chunk) {
   new_chunk->used = true;
   new_chunk->next = chunk->next;
   new_chunk->prev = chunk->prev;
-  if (chunk->next)
+  if (chunk->next) {
     chunk->next->prev = new_chunk;
-  if (chunk->prev)
+    seal_chunk(chunk->next);
+  }
+  if (chunk->prev) {
     chunk->prev->next = new_chunk;
+    seal_chunk(chunk->prev);
+  }
   if (pool->chunks == chunk)
     pool->chunks = new_chunk;
   if (pool->free_chunks == chunk)
     pool->free_chunks = new_chunk;
   if (pool->last_chunk == chunk)
     pool->last_chunk = new_chunk;
-  ft_memmove8(get_chunk_data(new_chunk), get_chunk_data(chunk), chunk->size);
-  munmap(chunk, get_chunk_size(chunk));
-  return new_chunk;
+}
+
+// large chunks own every page they touch, the header isn't always at the start
+// of the mapping (aligned allocations move it forward)
+static void unmap_large_chunk(t_chunk* chunk) {
+  uintptr_t base = align_down_to_power_of_2((uintptr_t)chunk, CONFIG.page_size);
+  uintptr_t end = align_up_to_power_of_2((uintptr_t)chunk + get_chunk_size(chunk), CONFIG.page_size);
+  unmap_pages((void*)base, end - base);
+  sub_resident(end - base);
 }
 
 static t_chunk* grow_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_size) {
@@ -185,35 +1068,44 @@ static t_chunk* grow_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_siz
   if (!chunk->next) {
     if (get_pool_unmapped_size(pool) < new_chunk_size)
       return NULL;
+    if (!reuse_pages(pool, pool->unmapped, (void*)chunk + new_chunk_size) || !touch_pool(pool, (void*)chunk + new_chunk_size))
+      return NULL;
+    count_chunk(pool, chunk, false);
     chunk->size = new_size;
     pool->unmapped = (void*)chunk + new_chunk_size;
+    count_chunk(pool, chunk, true);
     return chunk;
   }
   else if (
     !chunk->next->used &&
-    (get_chunk_size(chunk->next) + get_chunk_size(chunk) >= new_chunk_size)
+    (get_chunk_size(chunk->next) + get_chunk_size(chunk) >= new_chunk_size) &&
+    reuse_pages(pool, chunk->next, get_reused_end(chunk->next, (void*)chunk + new_chunk_size + sizeof(t_chunk)))
     ) {
+    count_chunk(pool, chunk, false);
     merge_two_chunks(pool, chunk, chunk->next);
-    if (can_split_chunk(pool, chunk, new_size)) {
+    if (can_split_chunk(pool, chunk, new_size))
       split_pool_chunk(pool, chunk, new_req_size);
-      return chunk;
-    }
+    count_chunk(pool, chunk, true);
     return chunk;
   }
   return NULL;
 }
 
 static t_chunk* build_large_pool_chunk(t_pool* pool, size_t requested_size) {
-  size_t chunk_size = align_up_to_power_of_2(align_up(requested_size) + sizeof(t_chunk), heap.page_size);
-  if (chunk_size > heap.limits.rlim_cur)
+  size_t chunk_size = align_up_to_power_of_2(align_up(requested_size) + sizeof(t_chunk), CONFIG.page_size);
+  if (chunk_size > CONFIG.limits.rlim_cur)
     return NULL;
   if (chunk_size == align_up(requested_size))
-    chunk_size += heap.page_size;
+    chunk_size += CONFIG.page_size;
   size_t data_size = chunk_size - sizeof(t_chunk);
   DEBUG_LOG("build_large_pool_chunk: pool %s[%p], requested_size %u, chunk_size %u\n", pool->slug, pool, requested_size, chunk_size);
-  t_chunk* chunk = mmap(NULL, chunk_size, MMAP_FLAGS);
+  if (!within_budget(chunk_size))
+    return NULL;
+  t_chunk* chunk = map_pages(chunk_size);
   if (chunk == MAP_FAILED)
     return NULL;
+  add_resident(chunk_size);
+  numa_bind(chunk, chunk_size, get_current_arena()->node);
   ft_bzero8(chunk, sizeof(t_chunk));
   chunk->size = data_size;
   chunk->used = true;
@@ -223,6 +1115,7 @@ static t_chunk* build_large_pool_chunk(t_pool* pool, size_t requested_size) {
     pool->chunks = chunk;
   else {
     pool->last_chunk->next = chunk;
+    seal_chunk(pool->last_chunk);
   }
   pool->last_chunk = chunk;
   assert_chunk_data(chunk);
@@ -248,6 +1141,8 @@ static uint8_t can_split_chunk(t_pool* pool, t_chunk* chunk, size_t split_size)
 // split the chunk in two chunks, returning the right half
 static t_chunk* split_pool_chunk(t_pool* pool, t_chunk* chunk, size_t requested_size) {
   DEBUG_LOG("split_pool_chunk: pool %p, chunk %p, requested_size %u\n", pool, chunk, requested_size);
+  uint64_t start = stat_clock();
+  PROBE(split, chunk, requested_size);
   size_t size = align_up(requested_size);
   ASSERT(can_split_chunk(pool, chunk, size) && "split_pool_chunk: can't split chunk");
   size_t chunk_size = get_chunk_size(chunk);
@@ -264,6 +1159,7 @@ static t_chunk* split_pool_chunk(t_pool* pool, t_chunk* chunk, size_t requested_
   if (chunk->next) {
     DEBUG_CHUNK(chunk);
     chunk->next->prev = right_chunk;
+    seal_chunk(chunk->next);
   }
   right_chunk->next = chunk->next;
   right_chunk->prev = chunk;
@@ -279,11 +1175,14 @@ static t_chunk* split_pool_chunk(t_pool* pool, t_chunk* chunk, size_t requested_
   right_chunk = merge_pool_chunks(pool, right_chunk);
   assert_chunk_data(chunk);
   assert_chunk_data(right_chunk);
+  record_stat(STAT_SPLIT, start);
   return right_chunk;
 }
 
 static t_chunk* merge_pool_chunks(t_pool* pool, t_chunk* chunk) {
   DEBUG_LOG("merge_pool_chunks: pool %p, chunk %p\n", pool, chunk);
+  uint64_t start = stat_clock();
+  PROBE(merge, chunk);
   t_chunk* next = chunk->next;
   while (next && !next->used) {
     merge_two_chunks(pool, chunk, next);
@@ -297,6 +1196,7 @@ static t_chunk* merge_pool_chunks(t_pool* pool, t_chunk* chunk) {
     assert_chunk_data(chunk);
     prev = prev->prev;
   }
+  record_stat(STAT_MERGE, start);
   return chunk;
 }
 
@@ -315,15 +1215,61 @@ static t_chunk* find_next_unused_chunk(t_pool* pool, t_chunk* chunk, size_t size
   return chunk;
 }
 
+// from the first fit, look a bit further for a chunk in a fuller zone (the
+// first one seen wins ties, so the lower address), new objects pack into busy
+// zones and the quiet ones get a chance to empty out
+static t_chunk* find_best_unused_chunk(t_pool* pool, size_t size) {
+  t_chunk* best = find_next_unused_chunk(pool, NULL, size);
+  if (!best)
+    return NULL;
+  uint32_t best_used = get_zone_used(pool, best);
+  t_chunk* chunk = best->next;
+  for (uint8_t i = 0; chunk && i < ZONE_SCAN_LIMIT; i++, chunk = chunk->next) {
+    if (chunk->used || chunk->size < size)
+      continue;
+    uint32_t used = get_zone_used(pool, chunk);
+    if (used > best_used) {
+      best = chunk;
+      best_used = used;
+    }
+  }
+  return best;
+}
+
 static t_chunk* alloc_pool_chunk(t_pool* pool, size_t requested_size) {
   size_t size = align_up(requested_size);
   DEBUG_LOG("alloc_pool_chunk: requested_size %u, size: %u\n", requested_size, size);
   ASSERT(size <= pool->max_chunk_size && "alloc_pool_chunk: requested_size > pool->max_chunk_size");
-  t_chunk* chunk = find_next_unused_chunk(pool, NULL, size);
+  uint64_t start = stat_clock();
+  // packing into fuller zones only pays off when empty zones get drained
+  t_chunk* chunk = CONFIG.enable_drain ? find_best_unused_chunk(pool, size) : find_next_unused_chunk(pool, NULL, size);
+  record_stat(STAT_POOL_SCAN, start);
+  PROBE(pool__scan, pool->slug, size, chunk);
   DEBUG_LOG("alloc_pool_chunk: next unused chunk %p, is tracked one? %b\n", chunk, chunk == pool->free_chunks);
   if (!chunk) {
     return build_pool_chunk(pool, requested_size);
   }
+  return take_pool_chunk(pool, chunk, requested_size);
+}
+
+// malloc_tiny/malloc_small: only the pool's tracked free chunk or its unmapped
+// tail, no scan, NULL when neither fits so the caller takes the generic path
+static t_chunk* alloc_pool_chunk_fast(t_pool* pool, size_t requested_size) {
+  size_t size = align_up(requested_size);
+  if (!pool->data || size + sizeof(t_chunk) > pool->max_chunk_size)
+    return NULL;
+  t_chunk* chunk = pool->free_chunks;
+  if (!chunk || chunk->size < size)
+    return build_pool_chunk(pool, requested_size);
+  return take_pool_chunk(pool, chunk, requested_size);
+}
+
+// chunk is free and big enough, mark it used and give what's left back to the pool
+static t_chunk* take_pool_chunk(t_pool* pool, t_chunk* chunk, size_t requested_size) {
+  size_t size = align_up(requested_size);
+  // the data plus the header of whatever gets split off
+  if (!reuse_pages(pool, chunk, get_reused_end(chunk, (void*)chunk + size + 2 * sizeof(t_chunk))))
+    return NULL;
   if (can_split_chunk(pool, chunk, size)) {
     split_pool_chunk(pool, chunk, requested_size);
     pool->free_chunks = NULL;
@@ -334,6 +1280,7 @@ static t_chunk* alloc_pool_chunk(t_pool* pool, size_t requested_size) {
     pool->free_chunks = NULL;
     pool->free_chunks = find_next_unused_chunk(pool, NULL, 0);
   }
+  count_chunk(pool, chunk, true);
   DEBUG_LOG("alloc_pool_chunk: chunk %p of size %u bytes\n", chunk, chunk->size);
   assert_chunk_data(chunk);
   return chunk;
@@ -342,6 +1289,7 @@ static t_chunk* alloc_pool_chunk(t_pool* pool, size_t requested_size) {
 static bool dealloc_pool_chunk(t_pool* pool, t_chunk* chunk) {
   DEBUG_LOG("dealloc_pool_chunk: chunk %p\n", chunk);
   ASSERT(chunk->used && "dealloc_pool_chunk: chunk is not used");
+  count_chunk(pool, chunk, false);
   chunk->used = false;
   chunk = merge_pool_chunks(pool, chunk);
   // if the chunk is the last one, we can move the unmapped pointer
@@ -351,8 +1299,10 @@ static bool dealloc_pool_chunk(t_pool* pool, t_chunk* chunk) {
     if (pool->chunks == chunk)
       pool->chunks = NULL;
     pool->last_chunk = chunk->prev;
-    if (chunk->prev)
+    if (chunk->prev) {
       chunk->prev->next = NULL;
+      seal_chunk(chunk->prev);
+    }
     pool->unmapped = (void*)chunk;
     pool->free_chunks = NULL;
     DEBUG_POOL(pool);
@@ -360,26 +1310,98 @@ static bool dealloc_pool_chunk(t_pool* pool, t_chunk* chunk) {
   }
   else
     update_pool_smallest_freed_chunk(pool, chunk);
+  if (CONFIG.enable_drain)
+    drain_pool(pool);
   return true;
 }
 
-static bool dealloc_large_pool_chunk(t_pool* pool, t_chunk* chunk) {
-  DEBUG_LOG("dealloc_large_pool_chunk: chunk %p\n", chunk);
-  ASSERT(chunk->used && "dealloc_large_pool_chunk: chunk is not used");
-  if (chunk->prev)
+static void unlink_large_pool_chunk(t_pool* pool, t_chunk* chunk) {
+  if (chunk->prev) {
     chunk->prev->next = chunk->next;
-  if (chunk->next)
+    seal_chunk(chunk->prev);
+  }
+  if (chunk->next) {
     chunk->next->prev = chunk->prev;
+    seal_chunk(chunk->next);
+  }
   if (pool->chunks == chunk)
     pool->chunks = chunk->next;
   if (pool->last_chunk == chunk)
     pool->last_chunk = chunk->prev;
-  bool ok = munmap(chunk, get_chunk_size(chunk)) == 0;
-  if (!ok)
-    return false;
+}
+
+static bool dealloc_large_pool_chunk(t_pool* pool, t_chunk* chunk) {
+  DEBUG_LOG("dealloc_large_pool_chunk: chunk %p\n", chunk);
+  ASSERT(chunk->used && "dealloc_large_pool_chunk: chunk is not used");
+  unlink_large_pool_chunk(pool, chunk);
+  unmap_large_chunk(chunk);
+  return true;
+}
+
+// the data is right aligned against the guard page, so overflows fault right away
+static t_chunk* build_guarded_chunk(t_pool* pool, size_t requested_size) {
+  size_t data_size = align_up(requested_size);
+  size_t span = align_up_to_power_of_2(data_size + sizeof(t_chunk), CONFIG.page_size);
+  DEBUG_LOG("build_guarded_chunk: requested_size %u, span %u\n", requested_size, span);
+  if (!within_budget(span))
+    return NULL;
+  void* base = map_pages(span + CONFIG.page_size);
+  if (base == MAP_FAILED)
+    return NULL;
+  if (mprotect(base + span, CONFIG.page_size, PROT_NONE) == -1) {
+    unmap_pages(base, span + CONFIG.page_size);
+    return NULL;
+  }
+  add_resident(span);
+  t_chunk* chunk = base + span - data_size - sizeof(t_chunk);
+  ft_bzero8(chunk, sizeof(t_chunk));
+  chunk->size = data_size;
+  chunk->used = true;
+  chunk->next = NULL;
+  chunk->prev = pool->last_chunk;
+  if (!pool->chunks)
+    pool->chunks = chunk;
+  else {
+    pool->last_chunk->next = chunk;
+    seal_chunk(pool->last_chunk);
+  }
+  pool->last_chunk = chunk;
+  return chunk;
+}
+
+// the whole mapping goes PROT_NONE into the quarantine, evicting the oldest one
+// its pages are dropped first, a quarantined chunk only costs address space
+static bool dealloc_guarded_chunk(t_pool* pool, t_chunk* chunk) {
+  DEBUG_LOG("dealloc_guarded_chunk: chunk %p\n", chunk);
+  unlink_large_pool_chunk(pool, chunk);
+  void* base = (void*)align_down_to_power_of_2((uintptr_t)chunk, CONFIG.page_size);
+  size_t len = get_chunk_data(chunk) + chunk->size + CONFIG.page_size - base;
+  madvise(base, len - CONFIG.page_size, MADV_DONTNEED);
+  sub_resident(len - CONFIG.page_size);
+  t_guard_slot* slot = &heap.guard_quarantine[heap.guard_quarantine_head];
+  heap.guard_quarantine_head = (heap.guard_quarantine_head + 1) % GUARD_QUARANTINE_SIZE;
+  if (slot->base)
+    unmap_pages(slot->base, slot->len);
+  slot->data = get_chunk_data(chunk);
+  slot->base = base;
+  slot->len = len;
+  if (mprotect(base, len, PROT_NONE) == -1) {
+    slot->data = NULL;
+    slot->base = NULL;
+    return unmap_pages(base, len) == 0;
+  }
   return true;
 }
 
+static bool dealloc_chunk(t_pool* pool, t_chunk* chunk) {
+  poison_chunk(chunk);
+  if (IS_GUARDED_POOL(pool))
+    return dealloc_guarded_chunk(pool, chunk);
+  if (IS_LARGE_POOL(pool))
+    return dealloc_large_pool_chunk(pool, chunk);
+  return dealloc_pool_chunk(pool, chunk);
+}
+
 static t_chunk* find_pool_chunk_by_data(t_pool* pool, void* ptr, bool large_pool) {
   DEBUG_LOG("find_pool_chunk_by_data: pool %s[%p], ptr %p, is_large: %b\n", pool->slug, pool->data, ptr, large_pool);
   DEBUG_POOL(pool);
@@ -407,55 +1429,197 @@ static t_chunk* find_pool_chunk_by_data(t_pool* pool, void* ptr, bool large_pool
   return NULL;
 }
 
+// O(1) lookup, reads the header in front of ptr and only trusts it if its
+// neighbours point back at it
+static t_chunk* find_pool_chunk_by_header(t_pool* pool, void* ptr) {
+  if (ptr < pool->data + sizeof(t_chunk) || ptr >= pool->unmapped || (uintptr_t)ptr % ALIGNMENT)
+    return NULL;
+  t_chunk* chunk = ptr - sizeof(t_chunk);
+  void* prev = chunk->prev;
+  void* next = chunk->next;
+  if (prev) {
+    if (prev < pool->data || prev >= (void*)chunk || ((t_chunk*)prev)->next != chunk)
+      return NULL;
+  }
+  else if (pool->chunks != chunk)
+    return NULL;
+  if (next) {
+    if (next <= (void*)chunk || next >= pool->unmapped || ((t_chunk*)next)->prev != chunk)
+      return NULL;
+  }
+  else if (pool->last_chunk != chunk)
+    return NULL;
+  return chunk;
+}
+
 static t_chunk* find_chunk_by_data(void* ptr, t_pool** pool) {
   t_chunk* chunk;
-  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
-    if (pool)
-      *pool = &heap.pools[i];
-    chunk = find_pool_chunk_by_data(&heap.pools[i], ptr, false);
-    if (chunk)
-      return chunk;
+  for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+    for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+      if (pool)
+        *pool = &heap.arenas[a].pools[i];
+      chunk = find_pool_chunk_by_data(&heap.arenas[a].pools[i], ptr, false);
+      if (chunk)
+        return chunk;
+    }
   }
   if (pool)
     *pool = &heap.large_pool;
-  return find_pool_chunk_by_data(&heap.large_pool, ptr, true);
+  chunk = find_pool_chunk_by_data(&heap.large_pool, ptr, true);
+  if (chunk || !GUARDED_POOL.chunks)
+    return chunk;
+  if (pool)
+    *pool = &GUARDED_POOL;
+  return find_pool_chunk_by_data(&GUARDED_POOL, ptr, true);
+}
+
+// rounding req_size up and adding the header has to stay below SIZE_MAX, a
+// wrapped size would land in the tiny pool as a chunk far too small
+static inline bool is_valid_request(size_t req_size) {
+  return req_size <= SIZE_MAX - sizeof(t_chunk) - ALIGNMENT;
 }
 
 static t_chunk* alloc(size_t req_size) {
   DEBUG_LOG("alloc: req_size %u\n", req_size);
-  build_pools();
-  if (req_size == 0)
+  if (req_size == 0 || !is_valid_request(req_size))
+    return NULL;
+  sample_chunk_size(align_up(req_size) + sizeof(t_chunk));
+  return alloc_class(get_size_class(align_up(req_size) + sizeof(t_chunk)), req_size, NULL);
+}
+
+// starts looking from size_class, the pools after it are only tried when it's full
+static t_chunk* alloc_class(uint8_t size_class, size_t req_size, t_pool** pool) {
+  if (!is_valid_request(req_size))
     return NULL;
   size_t size = align_up(req_size);
   size_t chunk_size = size + sizeof(t_chunk);
-  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
-    if (chunk_size <= heap.pools[i].max_chunk_size) {
-      if (!init_pool(&heap.pools[i]))
+  if (should_guard_chunk(chunk_size)) {
+    t_chunk* chunk = build_guarded_chunk(&GUARDED_POOL, req_size);
+    if (pool)
+      *pool = &GUARDED_POOL;
+    if (chunk)
+      return chunk;
+  }
+  t_arena* arena = get_current_arena();
+  for (uint8_t i = size_class; i < HEAP_POOLS; i++) {
+    if (chunk_size <= arena->pools[i].max_chunk_size) {
+      if (!init_pool(&arena->pools[i], arena->node))
         return NULL;
-      t_chunk* chunk = alloc_pool_chunk(&heap.pools[i], req_size);
+      t_chunk* chunk = alloc_pool_chunk(&arena->pools[i], req_size);
       if (!chunk)
         continue;
+      if (pool)
+        *pool = &arena->pools[i];
       return chunk;
     }
   }
+  if (pool)
+    *pool = &heap.large_pool;
   return build_large_pool_chunk(&heap.large_pool, req_size);
 }
 
+// what alloc_aligned asks the pools for, room to move the header forward, 0 on overflow
+static inline size_t get_aligned_request(size_t alignment, size_t req_size) {
+  size_t padded_size = req_size + alignment + sizeof(t_chunk) + ALIGNMENT;
+  return padded_size < req_size ? 0 : padded_size;
+}
+
+// over-allocate, then move the header forward so the data lands on the boundary
+// in a pool the skipped bytes become a free chunk, in a mapping the skipped pages get unmapped
+static t_chunk* alloc_aligned(size_t alignment, size_t req_size) {
+  DEBUG_LOG("alloc_aligned: alignment %u, req_size %u\n", alignment, req_size);
+  if (alignment <= ALIGNMENT)
+    return alloc(req_size);
+  if (req_size == 0)
+    return NULL;
+  size_t padded_size = get_aligned_request(alignment, req_size);
+  if (!padded_size)
+    return NULL;
+  t_pool* pool;
+  t_chunk* chunk = alloc_class(get_size_class(align_up(padded_size) + sizeof(t_chunk)), padded_size, &pool);
+  if (!chunk)
+    return NULL;
+  void* data = get_chunk_data(chunk);
+  void* end = data + chunk->size;
+  t_chunk* aligned_chunk = chunk;
+  count_chunk(pool, chunk, false);
+  if ((uintptr_t)data % alignment != 0) {
+    // leave room for a minimal free chunk in front of the aligned one
+    void* aligned_data = (void*)align_up_to_power_of_2((uintptr_t)data + sizeof(t_chunk) + ALIGNMENT, alignment);
+    aligned_chunk = aligned_data - sizeof(t_chunk);
+    if (IS_LARGE_POOL(pool)) {
+      ft_bzero8(aligned_chunk, sizeof(t_chunk));
+      aligned_chunk->size = end - aligned_data;
+      replace_large_pool_chunk(pool, chunk, aligned_chunk);
+      uintptr_t skipped = align_down_to_power_of_2((uintptr_t)chunk, CONFIG.page_size);
+      uintptr_t kept = align_down_to_power_of_2((uintptr_t)aligned_chunk, CONFIG.page_size);
+      if (kept > skipped) {
+        unmap_pages((void*)skipped, kept - skipped);
+        sub_resident(kept - skipped);
+      }
+      return aligned_chunk;
+    }
+    ft_bzero8(aligned_chunk, sizeof(t_chunk));
+    aligned_chunk->size = end - aligned_data;
+    aligned_chunk->used = true;
+    aligned_chunk->prev = chunk;
+    aligned_chunk->next = chunk->next;
+    if (chunk->next) {
+      chunk->next->prev = aligned_chunk;
+      seal_chunk(chunk->next);
+    }
+    chunk->next = aligned_chunk;
+    chunk->size = (void*)aligned_chunk - data;
+    if (pool->last_chunk == chunk)
+      pool->last_chunk = aligned_chunk;
+    count_chunk(pool, chunk, true);
+    dealloc_pool_chunk(pool, chunk);
+  }
+  if (can_split_chunk(pool, aligned_chunk, align_up(req_size)))
+    split_pool_chunk(pool, aligned_chunk, req_size);
+  count_chunk(pool, aligned_chunk, true);
+  assert_chunk_data(aligned_chunk);
+  return aligned_chunk;
+}
+
 static bool dealloc(void* ptr) {
   DEBUG_LOG("dealloc: ptr %p\n", ptr);
   if (!ptr)
     return false;
   t_pool* pool;
-  t_chunk* chunk;
-  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
-    pool = &heap.pools[i];
-    chunk = find_pool_chunk_by_data(pool, ptr, false);
-    if (chunk)
-      return dealloc_pool_chunk(pool, chunk);
+  // chunks always go back to the arena (and so the node) they came from
+  t_chunk* chunk = find_chunk_by_data(ptr, &pool);
+  if (!chunk) {
+    check_unknown_ptr(ptr);
+    return false;
   }
-  if ((chunk = find_pool_chunk_by_data(&heap.large_pool, ptr, true)))
-    return dealloc_large_pool_chunk(&heap.large_pool, chunk);
-  return false;
+  check_chunk(chunk, ptr);
+  return dealloc_chunk(pool, chunk);
+}
+
+// the size says which pool the chunk should be in, so only that one is looked at
+// anything unexpected (the pool was full, a guarded chunk, ...) goes through dealloc
+static bool dealloc_sized(void* ptr, size_t size) {
+  DEBUG_LOG("dealloc_sized: ptr %p, size %u\n", ptr, size);
+  if (!ptr)
+    return false;
+  uint8_t size_class = get_size_class(align_up(size) + sizeof(t_chunk));
+  t_pool* pool = NULL;
+  t_chunk* chunk = NULL;
+  if (size_class < HEAP_POOLS) {
+    for (uint8_t a = 0; a < CONFIG.arena_count && !chunk; a++) {
+      pool = &heap.arenas[a].pools[size_class];
+      chunk = find_pool_chunk_by_header(pool, ptr);
+    }
+  }
+  else {
+    pool = &LARGE_POOL;
+    chunk = find_pool_chunk_by_data(pool, ptr, true);
+  }
+  if (!chunk)
+    return dealloc(ptr);
+  check_chunk(chunk, ptr);
+  return dealloc_chunk(pool, chunk);
 }
 
 static t_chunk* realloc_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_size) {
@@ -464,7 +1628,9 @@ static t_chunk* realloc_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_
   if (chunk->size >= new_req_size) {
     DEBUG_LOG("realloc_pool_chunk: chunk %p has enough size -> %u bytes\n", chunk, chunk->size);
     if (can_split_chunk(pool, chunk, new_size)) {
+      count_chunk(pool, chunk, false);
       split_pool_chunk(pool, chunk, new_req_size);
+      count_chunk(pool, chunk, true);
       DEBUG_LOG("realloc_pool_chunk: splitted chunk %p\n", chunk);
     }
     DEBUG_CHUNK(chunk);
@@ -472,7 +1638,7 @@ static t_chunk* realloc_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_
     return chunk;
   }
   DEBUG_LOG("realloc_pool_chunk: chunk %p doesn't have enough size\n", chunk);
-  t_chunk* grown_chunk = grow_pool_chunk(pool, chunk, new_req_size);
+  t_chunk* grown_chunk = IS_GUARDED_POOL(pool) ? NULL : grow_pool_chunk(pool, chunk, new_req_size);
   if (grown_chunk) {
     DEBUG_LOG("realloc_pool_chunk: grown chunk %p\n", grown_chunk);
     return grown_chunk;
@@ -484,31 +1650,161 @@ static t_chunk* realloc_pool_chunk(t_pool* pool, t_chunk* chunk, size_t new_req_
   DEBUG_LOG("realloc_pool_chunk: new_chunk %p\n", new_chunk);
   ft_memmove8(get_chunk_data(new_chunk), get_chunk_data(chunk), chunk->size);
   DEBUG_LOG("realloc_pool_chunk: moved data from chunk %p to new_chunk %p\n", chunk, new_chunk);
-  if (dealloc_pool_chunk(pool, chunk))
+  if (dealloc_chunk(pool, chunk))
     DEBUG_LOG("realloc_pool_chunk: dealloced chunk %p\n", chunk);
   return new_chunk;
 }
 
-void* malloc(size_t size) {
-  pthread_mutex_lock(&lock);
-  build_pools();
-  t_chunk* chunk = alloc(size);
+// past the soft limit: give back every free page, then let the application
+// drop its own caches, the callbacks run without the lock so they can free
+static void relieve_pressure(void) {
+  if (!__atomic_load_n(&heap.pressure_pending, __ATOMIC_RELAXED) || !heap_lock())
+    return;
+  if (heap.in_pressure || !heap.pressure_pending) {
+    heap_unlock();
+    return;
+  }
+  __atomic_store_n(&heap.pressure_pending, false, __ATOMIC_RELAXED);
+  heap.in_pressure = true;
+  trim_heap();
+  size_t resident = heap.resident;
+  t_pressure_callback callbacks[PRESSURE_MAX_CALLBACKS];
+  for (uint8_t i = 0; i < PRESSURE_MAX_CALLBACKS; i++)
+    callbacks[i] = heap.pressure_callbacks[i];
+  heap_unlock();
+  for (uint8_t i = 0; i < PRESSURE_MAX_CALLBACKS; i++) {
+    if (callbacks[i].callback)
+      callbacks[i].callback(resident, CONFIG.soft_limit, callbacks[i].arg);
+  }
+  if (!heap_lock())
+    return;
+  heap.in_pressure = false;
+  // still over it, wait until it grows some more before firing again
+  if (heap.resident >= CONFIG.soft_limit)
+    heap.pressure_mark = heap.resident + CONFIG.soft_limit / 8;
+  __atomic_store_n(&heap.pressure_pending, false, __ATOMIC_RELAXED);
+  heap_unlock();
+}
+
+// common tail of the malloc entry points, releases the lock
+static void* end_malloc(t_chunk* chunk, size_t size, t_stat stat, uint64_t start) {
   assert_chunk_data(chunk);
-  if (heap.enable_log_chunk_alloc)
+  seal_chunk(chunk);
+  if (CONFIG.enable_log_chunk_alloc)
     show_chunk(2, chunk, 0, false);
-  pthread_mutex_unlock(&lock);
+  record_stat(stat, start);
+  PROBE(malloc__return, chunk ? get_chunk_data(chunk) : NULL, size);
+  heap_unlock();
+  relieve_pressure();
+  wake_provisioner();
   if (!chunk) {
     DEBUG_LOG("malloc: couldn't alloc %u bytes\n", size);
+    if (size)
+      errno = ENOMEM;
     return NULL;
   }
   return get_chunk_data(chunk);
 }
 
+void* malloc(size_t size) {
+  init_heap();
+  PROBE(malloc__entry, size);
+  uint64_t start = stat_clock();
+  if (!heap_lock())
+    return NULL;
+  return end_malloc(alloc(size), size, STAT_MALLOC, start);
+}
+
+// the size_class is known at compile time (see malloc_fast): no class lookup,
+// no guard or size sampling and no pool scan, a request the pool can't serve
+// that way (full, not mapped yet, past its threshold) goes through alloc
+static void* malloc_class(uint8_t size_class, size_t size) {
+  init_heap();
+  PROBE(malloc__entry, size);
+  uint64_t start = stat_clock();
+  if (!heap_lock())
+    return NULL;
+  t_chunk* chunk = NULL;
+  // malloc_tiny/malloc_small are public, size can be anything
+  if (size && is_valid_request(size)) {
+    chunk = alloc_pool_chunk_fast(&get_current_arena()->pools[size_class], size);
+    if (!chunk)
+      chunk = alloc(size);
+  }
+  return end_malloc(chunk, size, STAT_MALLOC_FAST, start);
+}
+
+void* malloc_tiny(size_t size) {
+  return malloc_class(TINY_POOL_IDX, size);
+}
+
+void* malloc_small(size_t size) {
+  return malloc_class(SMALL_POOL_IDX, size);
+}
+
+// a nested free from a signal handler leaks the chunk rather than deadlocking
 void free(void* ptr) {
-  pthread_mutex_lock(&lock);
-  build_pools();
+  init_heap();
+  PROBE(free__entry, ptr);
+  uint64_t start = stat_clock();
+  if (!heap_lock())
+    return;
   dealloc(ptr);
-  pthread_mutex_unlock(&lock);
+  record_stat(STAT_FREE, start);
+  heap_unlock();
+}
+
+void free_sized(void* ptr, size_t size) {
+  init_heap();
+  PROBE(free__entry, ptr);
+  uint64_t start = stat_clock();
+  if (!heap_lock())
+    return;
+  dealloc_sized(ptr, size);
+  record_stat(STAT_FREE, start);
+  heap_unlock();
+}
+
+// alloc_aligned picks the pool for the padded size, so that's the one looked at
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+  if (alignment > ALIGNMENT)
+    size = get_aligned_request(alignment, size);
+  if (size)
+    free_sized(ptr, size);
+  else
+    free(ptr);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  init_heap();
+  PROBE(malloc__entry, size);
+  uint64_t start = stat_clock();
+  if (!heap_lock())
+    return NULL;
+  return end_malloc(alloc_aligned(alignment, size), size, STAT_MALLOC, start);
+}
+
+void* memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) || alignment == 0)
+    return EINVAL;
+  void* ptr = aligned_alloc(alignment, size);
+  if (!ptr && size)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void* valloc(size_t size) {
+  init_heap();
+  return aligned_alloc(CONFIG.page_size, size);
 }
 
 void* realloc(void* ptr, size_t size) {
@@ -519,27 +1815,254 @@ void* realloc(void* ptr, size_t size) {
     free(ptr);
     return NULL;
   }
-  pthread_mutex_lock(&lock);
+  init_heap();
+  PROBE(realloc__entry, ptr, size);
+  uint64_t start = stat_clock();
+  if (!heap_lock())
+    return NULL;
   t_pool* pool;
   t_chunk* chunk = find_chunk_by_data(ptr, &pool);
   DEBUG_LOG("realloc: chunk %p, next\n", chunk);
 
   if (!chunk) {
-    pthread_mutex_unlock(&lock);
+    check_unknown_ptr(ptr);
+    heap_unlock();
     return NULL;
   }
+  check_chunk(chunk, ptr);
   DEBUG_CHUNK(chunk);
   DEBUG_CHUNK(chunk->next);
   chunk = realloc_pool_chunk(pool, chunk, size);
+  seal_chunk(chunk);
   DEBUG_LOG("realloc: new_chunk %p from pool %u\n", chunk, pool->size);
-  if (heap.enable_log_chunk_alloc)
+  if (CONFIG.enable_log_chunk_alloc)
     show_chunk(2, chunk, 0, false);
-  pthread_mutex_unlock(&lock);
-  if (!chunk)
+  record_stat(STAT_REALLOC, start);
+  PROBE(realloc__return, chunk ? get_chunk_data(chunk) : NULL, size);
+  heap_unlock();
+  relieve_pressure();
+  wake_provisioner();
+  if (!chunk) {
+    errno = ENOMEM;
     return NULL;
+  }
   return get_chunk_data(chunk);
 }
 
+// the callback runs once the heap goes past FT_MALLOC_SOFT_LIMIT, with the lock released
+int malloc_register_pressure_callback(void (*callback)(size_t resident, size_t soft_limit, void* arg), void* arg) {
+  init_heap();
+  if (!callback || !heap_lock())
+    return -1;
+  int ret = -1;
+  for (uint8_t i = 0; i < PRESSURE_MAX_CALLBACKS && ret == -1; i++) {
+    if (!heap.pressure_callbacks[i].callback) {
+      heap.pressure_callbacks[i].callback = callback;
+      heap.pressure_callbacks[i].arg = arg;
+      ret = 0;
+    }
+  }
+  heap_unlock();
+  return ret;
+}
+
+// a pressure event already in flight may still call it once
+int malloc_unregister_pressure_callback(void (*callback)(size_t resident, size_t soft_limit, void* arg), void* arg) {
+  init_heap();
+  if (!heap_lock())
+    return -1;
+  int ret = -1;
+  for (uint8_t i = 0; i < PRESSURE_MAX_CALLBACKS && ret == -1; i++) {
+    if (heap.pressure_callbacks[i].callback == callback && heap.pressure_callbacks[i].arg == arg) {
+      heap.pressure_callbacks[i].callback = NULL;
+      heap.pressure_callbacks[i].arg = NULL;
+      ret = 0;
+    }
+  }
+  heap_unlock();
+  return ret;
+}
+
+// pools have no top to keep, pad is only there for glibc compatibility
+int malloc_trim(size_t pad) {
+  (void)pad;
+  init_heap();
+  if (!heap_lock())
+    return 0;
+  size_t released = trim_heap();
+  heap_unlock();
+  return released > 0;
+}
+
+// every thread inside a critical section has seen the current epoch: move on and
+// free what was retired two epochs ago, nobody can still be reading it
+static void advance_epoch(void) {
+  uint64_t epoch = heap.epoch;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+    if (!heap.epoch_records[i].registered)
+      continue;
+    uint64_t state = __atomic_load_n(&heap.epoch_records[i].state, __ATOMIC_ACQUIRE);
+    if ((state & 1) && (state >> 1) != epoch)
+      return;
+  }
+  __atomic_store_n(&heap.epoch, epoch + 1, __ATOMIC_RELEASE);
+  t_retire_batch** safe = &heap.limbo[(epoch + 2) % 3];
+  while (*safe) {
+    t_retire_batch* batch = *safe;
+    *safe = batch->next;
+    for (size_t i = 0; i < batch->count; i++)
+      dealloc(batch->ptrs[i]);
+    dealloc(batch);
+  }
+}
+
+// the lock has to be held, the record's pointers join the current epoch's limbo
+static bool retire_epoch_record(t_epoch_record* record) {
+  advance_epoch();
+  if (!record->count)
+    return true;
+  t_chunk* chunk = alloc(sizeof(t_retire_batch));
+  if (!chunk)
+    return false;
+  seal_chunk(chunk);
+  t_retire_batch* batch = get_chunk_data(chunk);
+  batch->count = record->count;
+  for (uint32_t i = 0; i < record->count; i++)
+    batch->ptrs[i] = record->retired[i];
+  batch->next = heap.limbo[heap.epoch % 3];
+  heap.limbo[heap.epoch % 3] = batch;
+  record->count = 0;
+  return true;
+}
+
+// the record holds pointers or some limbo waits for the epoch to move
+static inline bool has_epoch_work(t_epoch_record* record) {
+  if (record->count)
+    return true;
+  for (int i = 0; i < 3; i++) {
+    if (__atomic_load_n(&heap.limbo[i], __ATOMIC_RELAXED))
+      return true;
+  }
+  return false;
+}
+
+static void epoch_key_destructor(void* value) {
+  (void)value;
+  malloc_epoch_unregister();
+}
+
+static void build_epoch_key(void) {
+  pthread_key_create(&epoch_key, epoch_key_destructor);
+}
+
+// free_deferred and malloc_epoch_enter register the thread on their own, this
+// only tells whether there was room left
+int malloc_epoch_register(void) {
+  init_heap();
+  if (epoch_slot >= 0)
+    return 0;
+  pthread_once(&epoch_key_once, build_epoch_key);
+  if (!heap_lock())
+    return -1;
+  for (int i = 0; i < EPOCH_MAX_THREADS && epoch_slot < 0; i++) {
+    t_epoch_record* record = &heap.epoch_records[i];
+    if (record->registered)
+      continue;
+    record->state = 0;
+    record->depth = 0;
+    record->count = 0;
+    record->exits = 0;
+    record->registered = true;
+    epoch_slot = i;
+  }
+  heap_unlock();
+  // the thread can't retire anything, its free_deferred calls keep failing
+  if (epoch_slot < 0) {
+    if (!__atomic_exchange_n(&heap.epoch_full, true, __ATOMIC_RELAXED))
+      ft_fprintf(2, "ft_malloc: more than %d threads in the epoch, free_deferred fails with EAGAIN\n", EPOCH_MAX_THREADS);
+    errno = EAGAIN;
+    return -1;
+  }
+  pthread_setspecific(epoch_key, &heap.epoch_records[epoch_slot]);
+  return 0;
+}
+
+// runs by itself when a registered thread exits
+void malloc_epoch_unregister(void) {
+  if (epoch_slot < 0 || !heap_lock())
+    return;
+  t_epoch_record* record = &heap.epoch_records[epoch_slot];
+  retire_epoch_record(record);
+  __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+  record->depth = 0;
+  record->registered = false;
+  epoch_slot = -1;
+  heap_unlock();
+  pthread_setspecific(epoch_key, NULL);
+}
+
+// nothing reachable when entering gets freed before the matching exit, can be nested
+int malloc_epoch_enter(void) {
+  if (malloc_epoch_register() == -1)
+    return -1;
+  t_epoch_record* record = &heap.epoch_records[epoch_slot];
+  if (record->depth++)
+    return 0;
+  uint64_t epoch = __atomic_load_n(&heap.epoch, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&record->state, epoch << 1 | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return 0;
+}
+
+void malloc_epoch_exit(void) {
+  if (epoch_slot < 0)
+    return;
+  t_epoch_record* record = &heap.epoch_records[epoch_slot];
+  if (!record->depth || --record->depth)
+    return;
+  __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+  // a thread retiring less than a batch, or none at all once the others are
+  // done, still gets what is waiting freed after a few intervals
+  if (++record->exits % EPOCH_EXIT_INTERVAL || !has_epoch_work(record) || !heap_lock())
+    return;
+  retire_epoch_record(record);
+  heap_unlock();
+}
+
+// ptr is freed once every thread that could have seen it left its critical section,
+// the lock is only taken once every EPOCH_BATCH calls, -1 leaves ptr to the caller
+int free_deferred(void* ptr) {
+  if (!ptr)
+    return 0;
+  if (malloc_epoch_register() == -1)
+    return -1;
+  t_epoch_record* record = &heap.epoch_records[epoch_slot];
+  if (record->count == EPOCH_BATCH) {
+    if (!heap_lock())
+      return -1;
+    bool retired = retire_epoch_record(record);
+    heap_unlock();
+    if (!retired) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  record->retired[record->count++] = ptr;
+  return 0;
+}
+
+// hand over what the thread retired so far and free whatever became safe
+void malloc_epoch_reclaim(void) {
+  if (epoch_slot < 0 || !heap_lock())
+    return;
+  retire_epoch_record(&heap.epoch_records[epoch_slot]);
+  // with nobody inside a critical section, two more epochs free everything
+  advance_epoch();
+  advance_epoch();
+  heap_unlock();
+}
+
 void* calloc(size_t nmemb, size_t size) {
   DEBUG_LOG("calloc: nmemb %u, size %u\n", nmemb, size);
   if (nmemb == 0 || size == 0)
@@ -604,40 +2127,57 @@ static void show_pool(t_pool* pool, size_t indent, bool dump, bool data) {
 }
 
 void show_heap(bool dump) {
-  build_pools();
+  init_heap();
   size_t total_allocated = 0;
   size_t total_used = 0;
   size_t total_freed = 0;
   ft_printf("Heap:\n");
-  ft_printf("- page_size: %u bytes\n", heap.page_size);
+  ft_printf("- page_size: %u bytes\n", CONFIG.page_size);
   ft_printf("- limits:\n");
-  ft_printf("  - soft: %u bytes\n", heap.limits.rlim_cur);
-  ft_printf("  - hard: %u bytes\n", heap.limits.rlim_max);
-  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
-    t_pool* pool = &heap.pools[i];
-    t_chunk* chunk = pool->chunks;
-    show_pool(pool, 0, dump, false);
-    ft_printf("- data:\n");
-    size_t pool_total_size = 0;
-    size_t pool_used_size = 0;
-    size_t pool_freed_size = 0;
-    while (chunk) {
-      show_chunk(1, chunk, 2, dump);
-      pool_total_size += chunk->size;
-      if (chunk->used)
-        pool_used_size += chunk->size;
-      else
-        pool_freed_size += chunk->size;
-      chunk = chunk->next;
+  ft_printf("  - soft: %u bytes\n", CONFIG.limits.rlim_cur);
+  ft_printf("  - hard: %u bytes\n", CONFIG.limits.rlim_max);
+  ft_printf("- resident: %u bytes\n", heap.resident);
+  ft_printf("- budget:\n");
+  ft_printf("  - soft: %u bytes\n", CONFIG.soft_limit);
+  ft_printf("  - hard: %u bytes\n", CONFIG.hard_limit);
+  ft_printf("- reserve: %u bytes in %u regions\n", heap.reserve_bytes, heap.reserve_count);
+  ft_printf("- arenas: %u\n", CONFIG.arena_count);
+  ft_printf("- numa_nodes: %u%s\n", CONFIG.numa_nodes, CONFIG.numa_nodes_forced ? " (forced)" : "");
+  for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+    ft_printf("Arena %u (node %d):\n", a, heap.arenas[a].node);
+    for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+      t_pool* pool = &heap.arenas[a].pools[i];
+      t_chunk* chunk = pool->chunks;
+      show_pool(pool, 0, dump, false);
+      ft_printf("- data:\n");
+      size_t pool_total_size = 0;
+      size_t pool_used_size = 0;
+      size_t pool_freed_size = 0;
+      while (chunk) {
+        show_chunk(1, chunk, 2, dump);
+        pool_total_size += chunk->size;
+        if (chunk->used)
+          pool_used_size += chunk->size;
+        else
+          pool_freed_size += chunk->size;
+        chunk = chunk->next;
+      }
+      ft_printf("- total: %u[%d%%] bytes\n", pool_total_size, pool_total_size * 100 / pool->size);
+      ft_printf("- used: %u[%d%%] bytes\n", pool_used_size, pool_used_size * 100 / pool->size);
+      ft_printf("- freed: %u[%d%%] bytes\n", pool_freed_size, pool_freed_size * 100 / pool->size);
+      size_t unmapped_size = get_pool_unmapped_size(pool);
+      ft_printf("- unmapped: %u[%d%%] bytes\n", unmapped_size, unmapped_size * 100 / pool->size);
+      if (CONFIG.enable_drain) {
+        uint8_t zones_used = 0;
+        for (uint8_t z = 0; z < POOL_MAX_ZONES; z++)
+          zones_used += pool->zone_used[z] != 0;
+        ft_printf("- zones: %u in use, %u bytes each\n", zones_used, 1UL << pool->zone_shift);
+      }
+      ft_printf("- fragmentation: %d%%\n", pool_total_size ? pool_freed_size * 100 / pool_total_size : 0);
+      total_allocated += pool_total_size;
+      total_used += pool_used_size;
+      total_freed += pool_freed_size;
     }
-    ft_printf("- total: %u[%d%%] bytes\n", pool_total_size, pool_total_size * 100 / pool->size);
-    ft_printf("- used: %u[%d%%] bytes\n", pool_used_size, pool_used_size * 100 / pool->size);
-    ft_printf("- freed: %u[%d%%] bytes\n", pool_freed_size, pool_freed_size * 100 / pool->size);
-    size_t unmapped_size = get_pool_unmapped_size(pool);
-    ft_printf("- unmapped: %u[%d%%] bytes\n", unmapped_size, unmapped_size * 100 / pool->size);
-    total_allocated += pool_total_size;
-    total_used += pool_used_size;
-    total_freed += pool_freed_size;
   }
   t_pool* pool = &heap.large_pool;
   t_chunk* chunk = pool->chunks;
@@ -655,15 +2195,36 @@ void show_heap(bool dump) {
   ft_printf("Total: %u bytes\n", total_allocated);
   ft_printf("Used: %u bytes\n", total_used);
   ft_printf("Freed: %u bytes\n", total_freed);
+  // free bytes stuck between used chunks, what the pools can't give back as a whole
+  ft_printf("Fragmentation: %d%%\n", total_used + total_freed ? total_freed * 100 / (total_used + total_freed) : 0);
 }
 
 void show_alloc_mem(void) {
-  pthread_mutex_lock(&lock);
+  init_heap();
+  if (!heap_lock())
+    return;
   size_t total = 0;
-  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
-    t_pool* pool = &heap.pools[i];
+  for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+    for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+      t_pool* pool = &heap.arenas[a].pools[i];
+      t_chunk* chunk = pool->chunks;
+      ft_printf("%s pool : %p\n", pool->slug, pool->data);
+      while (chunk) {
+        if (chunk->used) {
+          ft_printf("%p - %p : %u bytes\n", get_chunk_data(chunk), (void*)chunk + get_chunk_size(chunk), chunk->size);
+          total += chunk->size;
+        }
+        chunk = chunk->next;
+      }
+    }
+  }
+  t_pool* large_pools[] = {&heap.large_pool, &heap.guarded_pool};
+  for (uint8_t i = 0; i < 2; i++) {
+    t_pool* pool = large_pools[i];
     t_chunk* chunk = pool->chunks;
-    ft_printf("%s pool : %p\n", pool->slug, pool->data);
+    if (IS_GUARDED_POOL(pool) && !chunk)
+      continue;
+    ft_printf("%s pool : %p\n", pool->slug, pool->chunks ? pool->chunks : pool->data);
     while (chunk) {
       if (chunk->used) {
         ft_printf("%p - %p : %u bytes\n", get_chunk_data(chunk), (void*)chunk + get_chunk_size(chunk), chunk->size);
@@ -672,24 +2233,85 @@ void show_alloc_mem(void) {
       chunk = chunk->next;
     }
   }
-  t_pool* pool = &heap.large_pool;
-  t_chunk* chunk = pool->chunks;
-  ft_printf("%s pool : %p\n", pool->slug, pool->chunks ? pool->chunks : pool->data);
-  while (chunk) {
-    if (chunk->used) {
-      ft_printf("%p - %p : %u bytes\n", get_chunk_data(chunk), (void*)chunk + get_chunk_size(chunk), chunk->size);
-      total += chunk->size;
-    }
-    chunk = chunk->next;
-  }
   ft_printf("Total : %u bytes\n", total);
-  pthread_mutex_unlock(&lock);
+  heap_unlock();
 }
 
 void show_alloc_mem_ex(void) {
   show_heap(true);
 }
 
+// one line per non empty bucket, p50/p99 are the upper bound of their bucket
+static void show_stat(int target, const char* name, uint64_t* buckets) {
+  uint64_t count = 0;
+  for (uint8_t b = 0; b < STAT_BUCKETS; b++)
+    count += buckets[b];
+  if (!count)
+    return;
+  uint64_t p50 = 0;
+  uint64_t p99 = 0;
+  uint64_t seen = 0;
+  for (uint8_t b = 0; b < STAT_BUCKETS; b++) {
+    seen += buckets[b];
+    if (!p50 && seen * 2 >= count)
+      p50 = 1ULL << b;
+    if (!p99 && seen * 100 >= count * 99)
+      p99 = 1ULL << b;
+  }
+  ft_fprintf(target, "%s: %u calls, p50 < %u ns, p99 < %u ns\n", name, count, p50, p99);
+  for (uint8_t b = 0; b < STAT_BUCKETS; b++) {
+    if (buckets[b])
+      ft_fprintf(target, "  [%u, %u) ns: %u\n", b ? 1ULL << (b - 1) : 0, 1ULL << b, buckets[b]);
+  }
+}
+
+void show_alloc_stats(void) {
+  static const char* names[STAT_COUNT] = {
+    "malloc", "malloc fast path", "free", "realloc", "lock wait",
+    "pool scan", "split", "merge", "mmap", "munmap"
+  };
+  init_heap();
+  if (!CONFIG.enable_stats || !heap_lock())
+    return;
+  uint64_t stats[STAT_COUNT][STAT_BUCKETS];
+  for (uint8_t i = 0; i < STAT_COUNT; i++) {
+    for (uint8_t b = 0; b < STAT_BUCKETS; b++)
+      stats[i][b] = heap.stats[i][b];
+  }
+  heap_unlock();
+  ft_fprintf(2, "Latency:\n");
+  for (uint8_t i = 0; i < STAT_COUNT; i++)
+    show_stat(2, names[i], stats[i]);
+}
+
+// writes the current thresholds in the format FT_MALLOC_LAYOUT loads
+int malloc_export_layout(const char* path) {
+  init_heap();
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+  if (!heap_lock()) {
+    close(fd);
+    return -1;
+  }
+  // a layout still waiting for the heap to grow is the one worth keeping
+  uint32_t max_chunk_sizes[HEAP_POOLS];
+  for (uint8_t i = 0; i < HEAP_POOLS; i++)
+    max_chunk_sizes[i] = heap.adapt_pending ? clamp_pool_threshold(i, heap.adapt_layout[i]) : heap.arenas[0].pools[i].max_chunk_size;
+  heap_unlock();
+  for (uint8_t i = 0; i < HEAP_POOLS; i++)
+    ft_fprintf(fd, "%s %u\n", heap.arenas[0].pools[i].slug, max_chunk_sizes[i]);
+  return close(fd);
+}
+
+// a preloaded process never calls show_alloc_stats or malloc_export_layout itself
+__attribute__((destructor))
+static void heap_destructor(void) {
+  show_alloc_stats();
+  if (CONFIG.adapt_sample_rate && CONFIG.layout_path)
+    malloc_export_layout(CONFIG.layout_path);
+}
+
 #include <sys/ioctl.h>
 #define COLOR_RED "\033[0;31m"
 #define COLOR_GREEN "\033[0;32m"
@@ -739,15 +2361,21 @@ static void draw_pool(t_pool* pool, size_t term_width) {
 }
 
 void draw_heap(void) {
-  pthread_mutex_lock(&lock);
+  init_heap();
+  if (!heap_lock())
+    return;
   struct winsize w;
-  if (ioctl(0, TIOCGWINSZ, &w) == -1)
+  if (ioctl(0, TIOCGWINSZ, &w) == -1) {
+    heap_unlock();
     return;
-  for (uint8_t i = 0; i < HEAP_POOLS; i++) {
-    t_pool* pool = &heap.pools[i];
-    draw_pool(pool, w.ws_col);
+  }
+  for (uint8_t a = 0; a < CONFIG.arena_count; a++) {
+    for (uint8_t i = 0; i < HEAP_POOLS; i++) {
+      t_pool* pool = &heap.arenas[a].pools[i];
+      draw_pool(pool, w.ws_col);
+    }
   }
   t_pool* pool = &heap.large_pool;
   draw_pool(pool, w.ws_col);
-  pthread_mutex_unlock(&lock);
+  heap_unlock();
 }
@@ -0,0 +1,116 @@
+// replaceable operator new/delete, so c++ code reaches the pools directly
+// and sized deletes can skip the pointer probe in dealloc()
+// built into libft_malloc_cxx.so on its own, link (or preload) it next to
+// libft_malloc.so, the c lib itself doesn't depend on libstdc++
+
+#include <new>
+#include <cstddef>
+#include <malloc.h>
+
+static void* new_chunk(std::size_t size, std::size_t alignment) {
+  // new must hand out a unique pointer even for 0 bytes
+  if (size == 0)
+    size = 1;
+  for (;;) {
+    void* ptr = alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? aligned_alloc(alignment, size) : malloc(size);
+    if (ptr)
+      return ptr;
+    std::new_handler handler = std::get_new_handler();
+    if (!handler)
+      throw std::bad_alloc();
+    handler();
+  }
+}
+
+static void* new_chunk_nothrow(std::size_t size, std::size_t alignment) noexcept {
+  try {
+    return new_chunk(size, alignment);
+  }
+  catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new(std::size_t size) {
+  return new_chunk(size, 0);
+}
+
+void* operator new[](std::size_t size) {
+  return new_chunk(size, 0);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return new_chunk_nothrow(size, 0);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return new_chunk_nothrow(size, 0);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return new_chunk(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return new_chunk(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return new_chunk_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return new_chunk_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept {
+  free_sized(ptr, size ? size : 1);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept {
+  free_sized(ptr, size ? size : 1);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+  (void)alignment;
+  free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept {
+  (void)alignment;
+  free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  (void)alignment;
+  free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  (void)alignment;
+  free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
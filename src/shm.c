@@ -0,0 +1,297 @@
+// shared heap: same chunk list as the pools, but every link is an offset from
+// the start of the region and the lock is process shared, so any process
+// mapping the fd sees (and can update) the same heap
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <shm_heap.h>
+
+#define SHM_MAGIC 0x66745f6d616c6c63ULL
+#define SHM_ALIGNMENT 16
+
+// fixed width fields, the layout doesn't depend on who maps it
+typedef struct s_shm_chunk
+{
+  uint64_t size; // size of the segment after this header
+  uint32_t used;
+  uint32_t reserved;
+  uint64_t next; // offset of the next chunk, 0 if it's the last one
+  uint64_t prev; // offset of the prev chunk, 0 if it's the first one
+} t_shm_chunk;
+
+// lives at offset 0, so offset 0 never is a chunk and can stand for NULL
+struct s_shm_heap
+{
+  uint64_t magic; // written last, attach refuses the region until it's there
+  uint64_t size; // size of the whole mapping
+  pthread_mutex_t lock; // process shared and robust
+  uint64_t root; // offset of the object the creator published, 0 if none
+  uint64_t chunks; // offset of the first chunk
+  uint64_t last_chunk;
+  uint64_t unmapped; // offset of the first byte no chunk covers yet
+  uint64_t free_chunks; // no free chunk lives below this one
+};
+
+static inline uint64_t shm_align_up(uint64_t size) {
+  return (size + (SHM_ALIGNMENT - 1)) & ~(uint64_t)(SHM_ALIGNMENT - 1);
+}
+
+static inline uint64_t shm_data_start(void) {
+  return shm_align_up(sizeof(t_shm_heap));
+}
+
+static inline t_shm_chunk* get_shm_chunk(t_shm_heap* heap, uint64_t offset) {
+  return offset ? (t_shm_chunk*)((char*)heap + offset) : NULL;
+}
+
+static inline uint64_t get_shm_offset(t_shm_heap* heap, void* ptr) {
+  return ptr ? (uint64_t)((char*)ptr - (char*)heap) : 0;
+}
+
+static inline uint64_t get_shm_chunk_size(t_shm_chunk* chunk) {
+  return chunk->size + sizeof(t_shm_chunk);
+}
+
+// a process that died holding the lock leaves whatever it was doing half done,
+// the lists are taken as they are rather than refusing every later call
+static bool shm_lock(t_shm_heap* heap) {
+  int ret = pthread_mutex_lock(&heap->lock);
+  if (ret == EOWNERDEAD)
+    ret = pthread_mutex_consistent(&heap->lock);
+  return ret == 0;
+}
+
+static void shm_unlock(t_shm_heap* heap) {
+  pthread_mutex_unlock(&heap->lock);
+}
+
+static t_shm_heap* shm_map(int fd, size_t size) {
+  void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+// fd is resized to size, anything it held is lost
+t_shm_heap* shm_heap_create(int fd, size_t size) {
+  if (size < shm_data_start() + sizeof(t_shm_chunk) + SHM_ALIGNMENT) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (ftruncate(fd, size) == -1)
+    return NULL;
+  t_shm_heap* heap = shm_map(fd, size);
+  if (!heap)
+    return NULL;
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  int ret = pthread_mutex_init(&heap->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (ret != 0) {
+    munmap(heap, size);
+    errno = ret;
+    return NULL;
+  }
+  heap->size = size;
+  heap->root = 0;
+  heap->chunks = 0;
+  heap->last_chunk = 0;
+  heap->unmapped = shm_data_start();
+  heap->free_chunks = 0;
+  __atomic_store_n(&heap->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  return heap;
+}
+
+t_shm_heap* shm_heap_attach(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return NULL;
+  if ((size_t)st.st_size < sizeof(t_shm_heap)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  t_shm_heap* heap = shm_map(fd, st.st_size);
+  if (!heap)
+    return NULL;
+  if (__atomic_load_n(&heap->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || heap->size != (uint64_t)st.st_size) {
+    munmap(heap, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+  return heap;
+}
+
+void shm_heap_detach(t_shm_heap* heap) {
+  if (heap)
+    munmap(heap, heap->size);
+}
+
+// the lowest free chunk from offset on, the new free_chunks hint
+static uint64_t find_next_free_shm_chunk(t_shm_heap* heap, uint64_t offset) {
+  t_shm_chunk* chunk = get_shm_chunk(heap, offset);
+  while (chunk && chunk->used)
+    chunk = get_shm_chunk(heap, chunk->next);
+  return get_shm_offset(heap, chunk);
+}
+
+// cut what size doesn't need off the end of chunk as a free chunk
+static void split_shm_chunk(t_shm_heap* heap, t_shm_chunk* chunk, uint64_t size) {
+  if (chunk->size < size + sizeof(t_shm_chunk) + SHM_ALIGNMENT)
+    return;
+  t_shm_chunk* right = (t_shm_chunk*)((char*)chunk + sizeof(t_shm_chunk) + size);
+  right->size = chunk->size - size - sizeof(t_shm_chunk);
+  right->used = false;
+  right->reserved = 0;
+  right->next = chunk->next;
+  right->prev = get_shm_offset(heap, chunk);
+  if (chunk->next)
+    get_shm_chunk(heap, chunk->next)->prev = get_shm_offset(heap, right);
+  else
+    heap->last_chunk = get_shm_offset(heap, right);
+  chunk->next = get_shm_offset(heap, right);
+  chunk->size = size;
+}
+
+static t_shm_chunk* build_shm_chunk(t_shm_heap* heap, uint64_t size) {
+  if (heap->size - heap->unmapped < size + sizeof(t_shm_chunk))
+    return NULL;
+  t_shm_chunk* chunk = get_shm_chunk(heap, heap->unmapped);
+  chunk->size = size;
+  chunk->used = true;
+  chunk->reserved = 0;
+  chunk->next = 0;
+  chunk->prev = heap->last_chunk;
+  if (heap->last_chunk)
+    get_shm_chunk(heap, heap->last_chunk)->next = heap->unmapped;
+  else
+    heap->chunks = heap->unmapped;
+  heap->last_chunk = heap->unmapped;
+  heap->unmapped += get_shm_chunk_size(chunk);
+  return chunk;
+}
+
+// first fit from the hint, nothing below it is free
+static t_shm_chunk* alloc_shm_chunk(t_shm_heap* heap, uint64_t size) {
+  t_shm_chunk* chunk = get_shm_chunk(heap, heap->free_chunks);
+  while (chunk && (chunk->used || chunk->size < size))
+    chunk = get_shm_chunk(heap, chunk->next);
+  if (!chunk)
+    return build_shm_chunk(heap, size);
+  split_shm_chunk(heap, chunk, size);
+  chunk->used = true;
+  if (heap->free_chunks == get_shm_offset(heap, chunk))
+    heap->free_chunks = find_next_free_shm_chunk(heap, chunk->next);
+  return chunk;
+}
+
+static void merge_two_shm_chunks(t_shm_heap* heap, t_shm_chunk* a, t_shm_chunk* b) {
+  a->size += get_shm_chunk_size(b);
+  a->next = b->next;
+  if (b->next)
+    get_shm_chunk(heap, b->next)->prev = get_shm_offset(heap, a);
+  else
+    heap->last_chunk = get_shm_offset(heap, a);
+}
+
+static void dealloc_shm_chunk(t_shm_heap* heap, t_shm_chunk* chunk) {
+  chunk->used = false;
+  t_shm_chunk* next = get_shm_chunk(heap, chunk->next);
+  if (next && !next->used)
+    merge_two_shm_chunks(heap, chunk, next);
+  t_shm_chunk* prev = get_shm_chunk(heap, chunk->prev);
+  if (prev && !prev->used) {
+    merge_two_shm_chunks(heap, prev, chunk);
+    chunk = prev;
+  }
+  uint64_t offset = get_shm_offset(heap, chunk);
+  // the last chunk goes back to the unmapped tail
+  if (!chunk->next) {
+    if (chunk->prev)
+      get_shm_chunk(heap, chunk->prev)->next = 0;
+    else
+      heap->chunks = 0;
+    heap->last_chunk = chunk->prev;
+    heap->unmapped = offset;
+    if (heap->free_chunks >= offset)
+      heap->free_chunks = 0;
+    return;
+  }
+  if (!heap->free_chunks || offset < heap->free_chunks)
+    heap->free_chunks = offset;
+}
+
+// offset could hold a chunk header: aligned, past the heap header, before the tail
+static inline bool is_shm_chunk_offset(t_shm_heap* heap, uint64_t offset) {
+  return offset % SHM_ALIGNMENT == 0 && offset >= shm_data_start() && offset <= heap->unmapped - sizeof(t_shm_chunk);
+}
+
+// only trusts ptr if it sits inside the region and its neighbours point back at it,
+// the links are checked before being followed, ptr may be any interior pointer
+static t_shm_chunk* find_shm_chunk(t_shm_heap* heap, void* ptr) {
+  uint64_t data = get_shm_offset(heap, ptr);
+  if ((char*)ptr < (char*)heap || data % SHM_ALIGNMENT || data < shm_data_start() + sizeof(t_shm_chunk) || data >= heap->unmapped)
+    return NULL;
+  uint64_t offset = data - sizeof(t_shm_chunk);
+  t_shm_chunk* chunk = get_shm_chunk(heap, offset);
+  if (!chunk->used)
+    return NULL;
+  if (chunk->prev && (chunk->prev >= offset || !is_shm_chunk_offset(heap, chunk->prev)))
+    return NULL;
+  if (chunk->next && (chunk->next <= offset || !is_shm_chunk_offset(heap, chunk->next)))
+    return NULL;
+  if (chunk->prev ? get_shm_chunk(heap, chunk->prev)->next != offset : heap->chunks != offset)
+    return NULL;
+  if (chunk->next ? get_shm_chunk(heap, chunk->next)->prev != offset : heap->last_chunk != offset)
+    return NULL;
+  return chunk;
+}
+
+void* shm_malloc(t_shm_heap* heap, size_t size) {
+  if (!heap || size == 0 || size > heap->size)
+    return NULL;
+  if (!shm_lock(heap))
+    return NULL;
+  t_shm_chunk* chunk = alloc_shm_chunk(heap, shm_align_up(size));
+  shm_unlock(heap);
+  if (!chunk) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return (char*)chunk + sizeof(t_shm_chunk);
+}
+
+// pointers that aren't a live chunk of this heap are ignored
+void shm_free(t_shm_heap* heap, void* ptr) {
+  if (!heap || !ptr || !shm_lock(heap))
+    return;
+  t_shm_chunk* chunk = find_shm_chunk(heap, ptr);
+  if (chunk)
+    dealloc_shm_chunk(heap, chunk);
+  shm_unlock(heap);
+}
+
+// what another process passes to shm_pointer to find the same object
+uint64_t shm_offset(t_shm_heap* heap, void* ptr) {
+  return get_shm_offset(heap, ptr);
+}
+
+void* shm_pointer(t_shm_heap* heap, uint64_t offset) {
+  if (!offset || offset >= heap->size)
+    return NULL;
+  return (char*)heap + offset;
+}
+
+// one well known object, so a process attaching late can find everything else
+void shm_heap_set_root(t_shm_heap* heap, void* ptr) {
+  __atomic_store_n(&heap->root, get_shm_offset(heap, ptr), __ATOMIC_RELEASE);
+}
+
+void* shm_heap_root(t_shm_heap* heap) {
+  return shm_pointer(heap, __atomic_load_n(&heap->root, __ATOMIC_ACQUIRE));
+}
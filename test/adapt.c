@@ -0,0 +1,68 @@
+// FT_MALLOC_ADAPT: once most requests are just past the tiny pool it grows to
+// take them, but only after the heap grows again; until then the layout is
+// only pending, though malloc_export_layout already saves it
+
+#include <stdint.h>
+#include "test.h"
+
+#define SIZE 2000
+#define WARM 100
+#define SAMPLES 5000
+
+static uintptr_t tiny_pool;
+
+static int in_tiny_pool(void* ptr) {
+  return (uintptr_t)ptr >= tiny_pool && (uintptr_t)ptr < tiny_pool + 128 * sysconf(_SC_PAGESIZE);
+}
+
+static size_t get_tiny_threshold(void) {
+  char path[] = "/tmp/ft_malloc_layoutXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  close(fd);
+  CHECK(malloc_export_layout(path) == 0);
+  char layout[256] = {0};
+  fd = open(path, O_RDONLY);
+  CHECK(fd != -1 && read(fd, layout, sizeof(layout) - 1) > 0);
+  close(fd);
+  unlink(path);
+  CHECK(!strncmp(layout, "TINY ", 5));
+  return strtoul(layout + 5, NULL, 10);
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_ADAPT=1");
+  // the process is fresh, the first tiny chunk starts the pool
+  char* tiny = malloc(16);
+  tiny_pool = (uintptr_t)tiny - 32;
+  size_t threshold = get_tiny_threshold();
+  CHECK(threshold < SIZE);
+  // enough chunks handed out and back that the loop below never needs a new page
+  static char* warm[WARM];
+  for (int i = 0; i < WARM; i++)
+    CHECK((warm[i] = malloc(SIZE)));
+  char* fence = malloc(16);
+  for (int i = 0; i < WARM; i++)
+    free(warm[i]);
+  for (int i = 0; i < SAMPLES; i++) {
+    char* p = malloc(SIZE);
+    CHECK(p && !in_tiny_pool(p));
+    free(p);
+  }
+  // the new layout is settled but not applied
+  CHECK(get_tiny_threshold() >= SIZE + 32);
+  // the pools grow, the next allocation moves to the new layout
+  static char* grow[WARM * 2];
+  for (int i = 0; i < WARM * 2; i++)
+    CHECK((grow[i] = malloc(SIZE)));
+  char* p = malloc(SIZE);
+  CHECK(in_tiny_pool(p));
+  memset(p, 'x', SIZE);
+  free(p);
+  for (int i = 0; i < WARM * 2; i++)
+    free(grow[i]);
+  free(fence);
+  free(tiny);
+  return 0;
+}
@@ -0,0 +1,48 @@
+// FT_MALLOC_HARD_LIMIT: past the limit malloc fails with ENOMEM, and the pages
+// given back by trimming make room again, as many times as they are reused
+
+#include <errno.h>
+#include "test.h"
+
+#define ALLOCS 50
+#define SIZE 60000
+#define BIG (2 << 20)
+
+static size_t pressure_calls = 0;
+
+// a refused request counts as pressure too, whatever the resident size
+static void on_pressure(size_t resident, size_t soft_limit, void* arg) {
+  (void)arg;
+  CHECK(resident <= (4 << 20) && soft_limit == (4 << 20) / 8 * 7);
+  pressure_calls++;
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_HARD_LIMIT=4M");
+  CHECK(malloc_register_pressure_callback(on_pressure, NULL) == 0);
+  errno = 0;
+  CHECK(malloc(8 << 20) == NULL && errno == ENOMEM);
+  char* ptrs[ALLOCS];
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < ALLOCS; i++) {
+      CHECK((ptrs[i] = malloc(SIZE)));
+      memset(ptrs[i], 'x', SIZE);
+    }
+    // the pool holds about 3M, there is no room for 2M more
+    errno = 0;
+    CHECK(malloc(BIG) == NULL && errno == ENOMEM);
+    // the last one stays, the pool can't just shrink its tail
+    for (int i = 0; i < ALLOCS - 1; i++)
+      free(ptrs[i]);
+    malloc_trim(0);
+    // the purged pages left the budget, and come back into it once reused
+    char* big = malloc(BIG);
+    CHECK(big);
+    memset(big, 'x', BIG);
+    free(big);
+    free(ptrs[ALLOCS - 1]);
+  }
+  CHECK(pressure_calls > 0);
+  return 0;
+}
@@ -0,0 +1,135 @@
+// free_deferred: a handful of retired pointers (less than a batch) get freed
+// once the thread keeps entering and leaving critical sections, never while
+// another thread is still inside one, and the thread past EPOCH_MAX_THREADS
+// is told so instead of silently keeping its pointers
+
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "test.h"
+
+#define RETIRED 5
+#define SIZE 5000
+#define SECTIONS (64 * 4)
+#define MAX_THREADS 64
+
+static pthread_barrier_t entered;
+static pthread_barrier_t release;
+
+static void run_sections(void) {
+  for (int i = 0; i < SECTIONS; i++) {
+    CHECK(malloc_epoch_enter() == 0);
+    malloc_epoch_exit();
+  }
+}
+
+// retires RETIRED chunks and returns where the first one was
+static uintptr_t retire(void) {
+  char* ptrs[RETIRED];
+  for (int i = 0; i < RETIRED; i++)
+    CHECK((ptrs[i] = malloc(SIZE)));
+  CHECK(malloc_epoch_enter() == 0);
+  for (int i = 0; i < RETIRED; i++)
+    CHECK(free_deferred(ptrs[i]) == 0);
+  malloc_epoch_exit();
+  return (uintptr_t)ptrs[0];
+}
+
+// has the chunk at first gone back to the pool, the first fit hands it out again
+static int is_freed(uintptr_t first) {
+  char* p = malloc(SIZE);
+  CHECK(p);
+  int freed = (uintptr_t)p == first;
+  free(p);
+  return freed;
+}
+
+static void* reader(void* arg) {
+  (void)arg;
+  CHECK(malloc_epoch_enter() == 0);
+  pthread_barrier_wait(&entered);
+  pthread_barrier_wait(&release);
+  malloc_epoch_exit();
+  return NULL;
+}
+
+static void* registered(void* arg) {
+  (void)arg;
+  CHECK(malloc_epoch_register() == 0);
+  pthread_barrier_wait(&entered);
+  pthread_barrier_wait(&release);
+  return NULL;
+}
+
+static void* one_too_many(void* arg) {
+  (void)arg;
+  errno = 0;
+  CHECK(malloc_epoch_register() == -1 && errno == EAGAIN);
+  CHECK(malloc_epoch_enter() == -1);
+  char* p = malloc(SIZE);
+  errno = 0;
+  CHECK(free_deferred(p) == -1 && errno == EAGAIN);
+  // still the caller's
+  memset(p, 'x', SIZE);
+  free(p);
+  return NULL;
+}
+
+static void* registers(void* arg) {
+  (void)arg;
+  CHECK(malloc_epoch_register() == 0);
+  return NULL;
+}
+
+int main(void) {
+  char* fence = malloc(SIZE * 64);
+  uintptr_t first = retire();
+  run_sections();
+  CHECK(is_freed(first));
+
+  // a reader stuck inside its section holds everything retired after it entered
+  pthread_barrier_init(&entered, NULL, 2);
+  pthread_barrier_init(&release, NULL, 2);
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, reader, NULL) == 0);
+  pthread_barrier_wait(&entered);
+  first = retire();
+  run_sections();
+  CHECK(!is_freed(first));
+  pthread_barrier_wait(&release);
+  pthread_join(thread, NULL);
+  run_sections();
+  CHECK(is_freed(first));
+  pthread_barrier_destroy(&entered);
+  pthread_barrier_destroy(&release);
+
+  // main holds one record, the other threads take the rest
+  pthread_barrier_init(&entered, NULL, MAX_THREADS);
+  pthread_barrier_init(&release, NULL, MAX_THREADS);
+  pthread_t threads[MAX_THREADS - 1];
+  for (int i = 0; i < MAX_THREADS - 1; i++)
+    CHECK(pthread_create(&threads[i], NULL, registered, NULL) == 0);
+  pthread_barrier_wait(&entered);
+  char path[] = "/tmp/ft_malloc_epochXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  unlink(path);
+  int saved = dup(2);
+  CHECK(saved != -1 && dup2(fd, 2) == 2);
+  CHECK(pthread_create(&thread, NULL, one_too_many, NULL) == 0);
+  pthread_join(thread, NULL);
+  dup2(saved, 2);
+  char report[256] = {0};
+  CHECK(pread(fd, report, sizeof(report) - 1, 0) > 0);
+  CHECK(strstr(report, "more than 64 threads"));
+  close(fd);
+  close(saved);
+  pthread_barrier_wait(&release);
+  for (int i = 0; i < MAX_THREADS - 1; i++)
+    pthread_join(threads[i], NULL);
+  // exiting threads gave their records back
+  CHECK(pthread_create(&thread, NULL, registers, NULL) == 0);
+  pthread_join(thread, NULL);
+  free(fence);
+  return 0;
+}
@@ -0,0 +1,74 @@
+// fork while another thread is in the middle of allocating, the child must
+// find the heap consistent and unlocked, and a signal handler allocating on
+// top of the allocator must not deadlock
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "test.h"
+
+static volatile int stop = 0;
+
+static void* churn(void* arg) {
+  (void)arg;
+  void* ptrs[64] = {0};
+  for (size_t i = 0; !stop; i++) {
+    size_t slot = i % 64;
+    free(ptrs[slot]);
+    ptrs[slot] = malloc(1 + (i * 131) % 20000);
+  }
+  for (size_t i = 0; i < 64; i++)
+    free(ptrs[i]);
+  return NULL;
+}
+
+// a deadlocked child gets killed by the alarm and fails the wait below
+static void child(void) {
+  alarm(5);
+  for (int i = 0; i < 1000; i++) {
+    char* p = malloc(1 + i * 7);
+    CHECK(p);
+    p = realloc(p, 1 + i * 13);
+    CHECK(p);
+    free(p);
+  }
+  _exit(0);
+}
+
+static void handler(int sig) {
+  (void)sig;
+  // fails (NULL) when the thread was interrupted inside the allocator
+  free(malloc(32));
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_FORK_TRIM=1");
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, churn, NULL) == 0);
+  for (int i = 0; i < 100; i++) {
+    pid_t pid = fork();
+    CHECK(pid != -1);
+    if (pid == 0)
+      child();
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  stop = 1;
+  pthread_join(thread, NULL);
+  // the timer keeps landing in the middle of malloc/free
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  CHECK(sigaction(SIGPROF, &sa, NULL) == 0);
+  struct itimerval timer = {{0, 50}, {0, 50}};
+  CHECK(setitimer(ITIMER_PROF, &timer, NULL) == 0);
+  alarm(10);
+  for (int i = 0; i < 300000; i++)
+    free(malloc(1 + i % 5000));
+  struct itimerval off = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &off, NULL);
+  alarm(0);
+  return 0;
+}
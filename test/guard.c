@@ -0,0 +1,53 @@
+// FT_MALLOC_GUARD_SAMPLE: sampled allocations end right on a PROT_NONE page,
+// overflowing them or touching them once freed faults right away
+
+#include <signal.h>
+#include "test.h"
+
+#define ALLOCS 16
+
+// with a rate of 1 at least every other allocation is guarded
+static void overflow(void) {
+  for (int i = 0; i < ALLOCS; i++) {
+    char* p = malloc(100);
+    p[112] = 'x';
+  }
+}
+
+static void use_after_free(void) {
+  for (int i = 0; i < ALLOCS; i++) {
+    char* p = malloc(100);
+    char* alias = opaque(p);
+    free(p);
+    alias[0] = 'x';
+  }
+}
+
+static void double_free(void) {
+  for (int i = 0; i < ALLOCS; i++) {
+    char* p = malloc(100);
+    void* alias = opaque(p);
+    void* keep = malloc(100);
+    free(p);
+    free(alias);
+    (void)keep;
+  }
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_GUARD_SAMPLE=1", "FT_MALLOC_HARDEN=1");
+  CHECK(run_child(overflow) == SIGSEGV);
+  CHECK(run_child(use_after_free) == SIGSEGV);
+  CHECK(run_child(double_free) == SIGABRT);
+  // guarded chunks still behave like any other
+  for (int i = 0; i < 1000; i++) {
+    char* p = malloc(1 + i % 500);
+    CHECK(p);
+    memset(p, 'x', 1 + i % 500);
+    p = realloc(p, 1000);
+    CHECK(p && p[0] == 'x');
+    free(p);
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+// FT_MALLOC_HARDEN: double frees and clobbered headers abort instead of
+// corrupting the pools (or crashing somewhere else), and a busy workload
+// never trips the checks by itself
+
+#include <stdint.h>
+#include <signal.h>
+#include "test.h"
+
+static void double_free(void) {
+  void* a = malloc(64);
+  void* p = malloc(64);
+  void* alias = opaque(p);
+  void* b = malloc(64);
+  free(p);
+  free(alias);
+  free(a);
+  free(b);
+}
+
+// the next link, right in front of the canary check
+static void clobber_link(void) {
+  char* p = malloc(64);
+  void* q = malloc(64);
+  *(uint64_t*)(p - 16) = 0x4141414141414141ULL;
+  free(p);
+  free(q);
+}
+
+// a's overflow runs over b's header
+static void overflow(void) {
+  char* a = malloc(64);
+  char* b = malloc(64);
+  void* c = malloc(64);
+  memset(opaque(a), 'x', 64 + 24);
+  free(b);
+  free(c);
+}
+
+static void overflow_realloc(void) {
+  char* a = malloc(200);
+  char* b = malloc(200);
+  void* c = malloc(200);
+  memset(opaque(a), 'x', 208 + 16);
+  b = realloc(b, 400);
+  free(b);
+  free(c);
+}
+
+static void clobber_large(void) {
+  char* p = malloc(1 << 20);
+  void* q = malloc(1 << 20);
+  *(uint64_t*)(p - 8) = 0x4141414141414141ULL;
+  free(p);
+  free(q);
+}
+
+static void invalid_pointer(void) {
+  char* p = malloc(64);
+  void* q = malloc(64);
+  free(opaque(p + 16));
+  free(q);
+}
+
+#define SLOTS 512
+
+// every kind of allocation, split, merge and move, checked on every free
+static void churn(void) {
+  static char* ptrs[SLOTS];
+  static size_t sizes[SLOTS];
+  uint64_t rng = 42;
+  for (size_t i = 0; i < 200000; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    size_t slot = rng % SLOTS;
+    if (ptrs[slot]) {
+      CHECK((unsigned char)ptrs[slot][sizes[slot] - 1] == (slot & 0xff));
+      if (rng & 0x100) {
+        free(ptrs[slot]);
+        ptrs[slot] = NULL;
+        continue;
+      }
+    }
+    size_t size = 1 + (rng >> 20) % (rng & 0x200 ? 200000 : 3000);
+    char* ptr;
+    if (ptrs[slot])
+      ptr = realloc(ptrs[slot], size);
+    else if (rng & 0x400)
+      ptr = aligned_alloc(64 << (rng >> 40) % 4, size);
+    else
+      ptr = malloc(size);
+    CHECK(ptr);
+    ptr[size - 1] = slot & 0xff;
+    ptrs[slot] = ptr;
+    sizes[slot] = size;
+  }
+  for (size_t i = 0; i < SLOTS; i++)
+    free(ptrs[i]);
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_HARDEN=1");
+  CHECK(run_child(double_free) == SIGABRT);
+  CHECK(run_child(clobber_link) == SIGABRT);
+  CHECK(run_child(overflow) == SIGABRT);
+  CHECK(run_child(overflow_realloc) == SIGABRT);
+  CHECK(run_child(clobber_large) == SIGABRT);
+  CHECK(run_child(invalid_pointer) == SIGABRT);
+  churn();
+  return 0;
+}
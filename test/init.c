@@ -0,0 +1,63 @@
+// the heap is built once at startup, even when getrlimit fails (faked with a
+// seccomp filter) it comes up with every pool and serves every size
+
+#include <stddef.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <pthread.h>
+#include "test.h"
+
+// getrlimit and prlimit64 fail with EPERM, everything else goes through
+static void deny_getrlimit(void) {
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_prlimit64, 2, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_getrlimit, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+  };
+  struct sock_fprog prog = {sizeof(filter) / sizeof(filter[0]), filter};
+  CHECK(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0);
+  CHECK(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == 0);
+}
+
+static void* allocate(void* arg) {
+  (void)arg;
+  for (size_t size = 1; size < (1 << 22); size = size * 3 + 1) {
+    char* p = malloc(size);
+    CHECK(p);
+    p[0] = p[size - 1] = 'x';
+    free(p);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  // the filter follows the exec, so the lib sees it from its first call
+  if (!getenv("FT_MALLOC_TEST_ENV"))
+    deny_getrlimit();
+  TEST_ENV(argv, "FT_MALLOC_ASSERT=1");
+  struct rlimit limits;
+  CHECK(getrlimit(RLIMIT_AS, &limits) == -1);
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++)
+    CHECK(pthread_create(&threads[t], NULL, allocate, NULL) == 0);
+  for (int t = 0; t < 4; t++)
+    pthread_join(threads[t], NULL);
+  // tiny and small requests come from the pools, not one mapping each
+  char* a = malloc(32);
+  char* b = malloc(32);
+  char* c = malloc(4000);
+  char* d = malloc(4000);
+  CHECK(a && b && c && d);
+  CHECK(b - a == 64 && d - c == 4032);
+  free(a);
+  free(b);
+  free(c);
+  free(d);
+  return 0;
+}
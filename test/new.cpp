@@ -0,0 +1,122 @@
+// operator new/delete from libft_malloc_cxx: every overload reaches the pools,
+// failures throw or return null as the standard says, the new_handler gets
+// its chance, and sized/aligned deletes hand the chunk back
+
+#include <new>
+#include <vector>
+#include <cstdint>
+#include <dlfcn.h>
+#include <ft_allocator.hpp>
+#include "test.h"
+
+struct alignas(256) aligned {
+  char data[300];
+};
+
+static void* reserve = nullptr;
+static int handler_calls = 0;
+
+// gives the reserve back once, then gives up
+static void release_reserve() {
+  handler_calls++;
+  if (reserve) {
+    free(reserve);
+    reserve = nullptr;
+  }
+  else
+    std::set_new_handler(nullptr);
+}
+
+int main() {
+  // the program links libft_malloc_cxx first, the operators resolve to it
+  Dl_info info;
+  void* (*new_fn)(std::size_t) = &::operator new;
+  CHECK(dladdr(reinterpret_cast<void*>(new_fn), &info) && strstr(info.dli_fname, "libft_malloc_cxx"));
+
+  int* one = new int(42);
+  int* many = new int[1000]();
+  CHECK(*one == 42 && many[999] == 0);
+  delete one;
+  delete[] many;
+
+  // the freed chunk is reused, so sized delete did give it back
+  uintptr_t freed;
+  {
+    char* p = static_cast<char*>(::operator new(200));
+    freed = reinterpret_cast<uintptr_t>(p);
+    ::operator delete(p, 200);
+    char* q = static_cast<char*>(malloc(200));
+    CHECK(reinterpret_cast<uintptr_t>(q) == freed);
+    free(q);
+  }
+
+  aligned* a = new aligned;
+  aligned* arr = new aligned[7];
+  CHECK(reinterpret_cast<uintptr_t>(a) % 256 == 0 && reinterpret_cast<uintptr_t>(arr) % 256 == 0);
+  delete a;
+  delete[] arr;
+  for (std::size_t align = 32; align <= 8192; align *= 2) {
+    for (std::size_t size = 1; size < 200000; size = size * 5 + 3) {
+      void* p = ::operator new(size, std::align_val_t(align));
+      CHECK(reinterpret_cast<uintptr_t>(p) % align == 0);
+      memset(p, 'x', size);
+      ::operator delete(p, size, std::align_val_t(align));
+    }
+  }
+  // the padded size points at the chunk's pool, which gets it back
+  {
+    void* p = ::operator new(100, std::align_val_t(64));
+    freed = reinterpret_cast<uintptr_t>(p);
+    ::operator delete(p, 100, std::align_val_t(64));
+    void* q = ::operator new(100, std::align_val_t(64));
+    CHECK(reinterpret_cast<uintptr_t>(q) == freed);
+    ::operator delete(q, std::align_val_t(64));
+  }
+
+  std::size_t huge = static_cast<std::size_t>(1) << 62;
+  CHECK(::operator new(huge, std::nothrow) == nullptr);
+  CHECK(::operator new[](huge, std::align_val_t(64), std::nothrow) == nullptr);
+  bool thrown = false;
+  try {
+    (void)::operator new(huge);
+  }
+  catch (const std::bad_alloc&) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  // close enough to SIZE_MAX that rounding it up with the header would wrap
+  // (volatile, or gcc refuses the constant at compile time)
+  volatile std::size_t wrapping = SIZE_MAX - 8;
+  CHECK(::operator new(wrapping, std::nothrow) == nullptr);
+  CHECK(::operator new[](wrapping, std::nothrow) == nullptr);
+  CHECK(::operator new(wrapping, std::align_val_t(64), std::nothrow) == nullptr);
+  CHECK(malloc(wrapping + 8) == nullptr && malloc(wrapping - 32) == nullptr);
+  thrown = false;
+  try {
+    (void)::operator new(wrapping);
+  }
+  catch (const std::bad_alloc&) {
+    thrown = true;
+  }
+  CHECK(thrown);
+
+  // the handler runs until it gives up, then new throws
+  reserve = malloc(1000);
+  std::set_new_handler(release_reserve);
+  thrown = false;
+  try {
+    (void)::operator new(huge);
+  }
+  catch (const std::bad_alloc&) {
+    thrown = true;
+  }
+  CHECK(thrown && handler_calls == 2 && !reserve);
+
+  std::vector<int, ft::allocator<int>> vec;
+  for (int i = 0; i < 100000; i++)
+    vec.push_back(i);
+  CHECK(vec[99999] == 99999);
+  std::vector<aligned, ft::allocator<aligned>> aligned_vec(10);
+  CHECK(reinterpret_cast<uintptr_t>(aligned_vec.data()) % 256 == 0);
+  return 0;
+}
@@ -0,0 +1,67 @@
+// arenas: allocations from several threads over faked nodes stay intact and
+// can be freed from any thread, a thread moving to another cpu moves arena
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "test.h"
+
+#define THREADS 8
+#define ALLOCS 2000
+
+static void* allocate(void* arg) {
+  unsigned char** ptrs = arg;
+  for (size_t i = 0; i < ALLOCS; i++) {
+    size_t size = 1 + (i * 37) % 3000;
+    ptrs[i] = malloc(size);
+    CHECK(ptrs[i]);
+    memset(ptrs[i], (int)(i & 0xff), size);
+  }
+  return NULL;
+}
+
+// enough allocations for the per thread arena cache to notice the move
+static void* allocate_on(int cpu, void** ptrs, size_t count) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  CHECK(sched_setaffinity(0, sizeof(set), &set) == 0);
+  for (size_t i = 0; i < count; i++) {
+    ptrs[i] = malloc(64);
+    CHECK(ptrs[i]);
+  }
+  return ptrs[count - 1];
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_NUMA_NODES=4", "FT_MALLOC_NUMA_ARENAS_PER_NODE=2");
+  static unsigned char* ptrs[THREADS][ALLOCS];
+  pthread_t threads[THREADS];
+  for (int t = 0; t < THREADS; t++)
+    CHECK(pthread_create(&threads[t], NULL, allocate, ptrs[t]) == 0);
+  for (int t = 0; t < THREADS; t++)
+    pthread_join(threads[t], NULL);
+  // freed by another thread than the one that allocated them
+  for (int t = 0; t < THREADS; t++) {
+    for (size_t i = 0; i < ALLOCS; i++) {
+      size_t size = 1 + (i * 37) % 3000;
+      CHECK(ptrs[t][i][0] == (i & 0xff) && ptrs[t][i][size - 1] == (i & 0xff));
+      free(ptrs[t][i]);
+    }
+  }
+  if (sysconf(_SC_NPROCESSORS_ONLN) >= 2) {
+    static void* first[256];
+    static void* second[256];
+    // cpu 0 and 1 land on faked nodes 0 and 1, so on pools mapped apart
+    uintptr_t a = (uintptr_t)allocate_on(0, first, 256);
+    uintptr_t b = (uintptr_t)allocate_on(1, second, 256);
+    CHECK((a > b ? a - b : b - a) > 64 * 4096);
+    for (size_t i = 0; i < 256; i++) {
+      free(first[i]);
+      free(second[i]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,86 @@
+// FT_MALLOC_RESERVE_POPULATE: the prefaulted reserve counts against
+// FT_MALLOC_HARD_LIMIT, the provisioner stops filling it at the soft limit,
+// and allocations needing the room get it back from the reserve; pools
+// created after a refill are carved out of it without a new mapping
+
+#include <stdint.h>
+#include "test.h"
+
+#define LIMIT (32 << 20)
+#define SIZE (1 << 20)
+#define ALLOCS 64
+
+static size_t get_rss(void) {
+  char buf[128] = {0};
+  int fd = open("/proc/self/statm", O_RDONLY);
+  CHECK(fd != -1 && read(fd, buf, sizeof(buf) - 1) > 0);
+  close(fd);
+  char* end;
+  strtoul(buf, &end, 10);
+  return strtoul(end, NULL, 10) * sysconf(_SC_PAGESIZE);
+}
+
+// how many times the heap has called mmap so far, from show_alloc_stats
+static unsigned long get_mmap_calls(void) {
+  char path[] = "/tmp/ft_malloc_reserveXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  unlink(path);
+  int saved = dup(2);
+  CHECK(saved != -1 && dup2(fd, 2) == 2);
+  show_alloc_stats();
+  dup2(saved, 2);
+  close(saved);
+  static char report[1 << 16];
+  ssize_t len = pread(fd, report, sizeof(report) - 1, 0);
+  CHECK(len > 0);
+  report[len] = 0;
+  close(fd);
+  const char* found = strstr(report, "\nmmap: ");
+  CHECK(found);
+  return strtoul(found + 7, NULL, 10);
+}
+
+// the provisioner fills the reserve in the background, waits until it's done
+static void wait_reserve(void) {
+  size_t rss = 0;
+  for (int stable = 0, i = 0; stable < 5 && i < 400; i++) {
+    usleep(5000);
+    size_t now = get_rss();
+    stable = now == rss ? stable + 1 : 0;
+    rss = now;
+  }
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  TEST_ENV(argv, "FT_MALLOC_RESERVE=64M", "FT_MALLOC_RESERVE_POPULATE=1", "FT_MALLOC_HARD_LIMIT=32M",
+    "FT_MALLOC_STATS=1");
+  size_t base = get_rss();
+  free(malloc(SIZE));
+  wait_reserve();
+  // 64M were asked for, the soft limit (28M) stops it well before
+  CHECK(get_rss() - base <= LIMIT);
+  // the first small chunk creates its pool, the reserve has the pages for it
+  unsigned long mmaps = get_mmap_calls();
+  char* small = malloc(2000);
+  CHECK(small && get_mmap_calls() == mmaps);
+  memset(small, 'x', 2000);
+  // the allocations take the reserve back, all the way up to the hard limit
+  char* ptrs[ALLOCS];
+  size_t count = 0;
+  while (count < ALLOCS && (ptrs[count] = malloc(SIZE))) {
+    memset(ptrs[count], 'x', SIZE);
+    count++;
+  }
+  CHECK(count >= 24 && count < ALLOCS);
+  wait_reserve();
+  CHECK(get_rss() - base <= LIMIT + (2 << 20));
+  for (size_t i = 0; i < count; i++)
+    free(ptrs[i]);
+  free(small);
+  // keeps the stats printed at exit out of the test output
+  int null = open("/dev/null", O_WRONLY);
+  CHECK(null != -1 && dup2(null, 2) == 2);
+  return 0;
+}
@@ -0,0 +1,111 @@
+// shared heap: a child attaches the memfd at its own address, allocates and
+// publishes through the root object, the parent reads it back; shm_free
+// ignores anything that isn't a live chunk, even with garbage where the
+// links would be
+
+#define _GNU_SOURCE // memfd_create
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <shm_heap.h>
+#include "test.h"
+
+#define HEAP_SIZE (1 << 20)
+#define MESSAGES 100
+
+typedef struct {
+  uint64_t count;
+  uint64_t messages[MESSAGES]; // offsets, each process maps the heap elsewhere
+} t_root;
+
+// the layout shm.c uses for its chunk headers
+typedef struct {
+  uint64_t size;
+  uint64_t used;
+  uint64_t next;
+  uint64_t prev;
+} t_header;
+
+static int fd;
+static t_shm_heap* heap;
+
+static void child(void) {
+  t_shm_heap* attached = shm_heap_attach(fd);
+  CHECK(attached);
+  t_root* root = shm_heap_root(attached);
+  CHECK(root);
+  for (int i = 0; i < MESSAGES; i++) {
+    char* msg = shm_malloc(attached, 32 + i);
+    CHECK(msg);
+    snprintf(msg, 32 + i, "message %d", i);
+    root->messages[i] = shm_offset(attached, msg);
+    root->count++;
+  }
+  shm_heap_detach(attached);
+}
+
+// a fake header with one wild link inside the data, then an interior
+// pointer right behind it
+static void free_wild(uint64_t prev, uint64_t next) {
+  char* data = shm_malloc(heap, 256);
+  CHECK(data);
+  t_header* fake = (t_header*)(data + 64);
+  fake->size = 64;
+  fake->used = 1;
+  fake->prev = prev;
+  fake->next = next;
+  shm_free(heap, fake + 1);
+  shm_free(heap, data + 16);
+  shm_free(heap, data);
+}
+
+static void free_wild_prev(void) {
+  free_wild(0x7ffffffffff0, 0);
+}
+
+static void free_wild_next(void) {
+  free_wild(0, 0x7ffffffffff0);
+}
+
+static void free_unaligned_prev(void) {
+  free_wild(0x48, 0);
+}
+
+int main(void) {
+  CHECK((fd = memfd_create("ft_malloc_test", 0)) != -1);
+  CHECK((heap = shm_heap_create(fd, HEAP_SIZE)));
+  t_root* root = shm_malloc(heap, sizeof(t_root));
+  CHECK(root);
+  memset(root, 0, sizeof(t_root));
+  shm_heap_set_root(heap, root);
+  // the child maps it a second time, it doesn't reuse the inherited address
+  pid_t pid = fork();
+  CHECK(pid != -1);
+  if (pid == 0) {
+    child();
+    _exit(0);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(root->count == MESSAGES);
+  char expected[32];
+  for (int i = 0; i < MESSAGES; i++) {
+    char* msg = shm_pointer(heap, root->messages[i]);
+    snprintf(expected, sizeof(expected), "message %d", i);
+    CHECK(msg && !strcmp(msg, expected));
+  }
+  // the parent frees what the child allocated
+  for (int i = 0; i < MESSAGES; i++)
+    shm_free(heap, shm_pointer(heap, root->messages[i]));
+  CHECK(run_child(free_wild_prev) == 0);
+  CHECK(run_child(free_wild_next) == 0);
+  CHECK(run_child(free_unaligned_prev) == 0);
+  // everything after the root went back to the tail, the next chunk goes right after it
+  char* next = shm_malloc(heap, 16);
+  CHECK(next && next == (char*)root + ((sizeof(t_root) + 15) & ~15) + sizeof(t_header));
+  shm_free(heap, next);
+  shm_free(heap, root);
+  shm_heap_detach(heap);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,72 @@
+// malloc_tiny/malloc_small and malloc_fast: constant sizes go straight to
+// their pool, reuse what was freed there, and anything the pool can't take
+// still gets served
+
+#include <errno.h>
+#include <stdint.h>
+#include "test.h"
+
+#define ALLOCS 20000
+
+int main(void) {
+  CHECK(malloc_tiny(0) == NULL);
+  CHECK(malloc_small(0) == NULL);
+  // fresh pool, chunks come off the unmapped tail one after the other
+  char* a = malloc_fast(48);
+  char* b = malloc_fast(48);
+  CHECK(a && b && b - a == 48 + 32);
+  // the freed chunk is the one handed out next
+  uintptr_t freed = (uintptr_t)a;
+  free(a);
+  a = malloc_fast(48);
+  CHECK((uintptr_t)a == freed);
+  char* c = malloc_fast(8000);
+  char* d = malloc_fast(8000);
+  CHECK(c && d && d - c == 8000 + 32);
+  freed = (uintptr_t)c;
+  free(c);
+  c = malloc_fast(8000);
+  CHECK((uintptr_t)c == freed);
+  // both pools are mapped, called directly with a size that wraps once rounded up with its header
+  volatile size_t wrapping = SIZE_MAX - 8;
+  errno = 0;
+  CHECK(malloc_tiny(wrapping) == NULL && errno == ENOMEM);
+  CHECK(malloc_small(wrapping + 8) == NULL && malloc_small(wrapping - 32) == NULL);
+  // not constant, or past what the pool takes: plain malloc, still served
+  size_t size = FT_MALLOC_SMALL_MAX_SIZE * 4;
+  char* large = malloc_fast(size);
+  char* past = malloc_small(size);
+  CHECK(large && past);
+  large[size - 1] = past[size - 1] = 'x';
+  free(large);
+  free(past);
+  // the biggest request of each class fits its pool
+  char* tiny_max = malloc_tiny(FT_MALLOC_TINY_MAX_SIZE);
+  char* small_max = malloc_small(FT_MALLOC_SMALL_MAX_SIZE);
+  CHECK(tiny_max && small_max);
+  CHECK((uintptr_t)tiny_max - (uintptr_t)a < 128 * 4096);
+  CHECK((uintptr_t)small_max - (uintptr_t)c < 1024 * 4096);
+  free(tiny_max);
+  free(small_max);
+  // fills both pools past their size, the fast path has to hand over
+  static char* ptrs[ALLOCS];
+  for (size_t i = 0; i < ALLOCS; i++) {
+    ptrs[i] = i % 2 ? malloc_fast(1000) : malloc_fast(2000);
+    CHECK(ptrs[i]);
+    memset(ptrs[i], (int)(i & 0xff), i % 2 ? 1000 : 2000);
+  }
+  for (size_t i = 0; i < ALLOCS; i += 2)
+    free(ptrs[i]);
+  for (size_t i = 0; i < ALLOCS; i += 2)
+    CHECK((ptrs[i] = malloc_fast(2000)));
+  for (size_t i = 0; i < ALLOCS; i++) {
+    if (i % 2)
+      CHECK((unsigned char)ptrs[i][999] == (i & 0xff));
+    free(ptrs[i]);
+  }
+  free(a);
+  free(b);
+  free(c);
+  free(d);
+  return 0;
+}
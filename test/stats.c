@@ -0,0 +1,77 @@
+// FT_MALLOC_STATS: every call lands in its latency histogram, show_alloc_stats
+// prints them, and so does the library at exit; without it nothing is printed
+
+#include "test.h"
+
+static char report[1 << 16];
+
+// runs fn with stderr going to a file, exit included, returns what it wrote
+static const char* capture(void (*fn)(void)) {
+  char path[] = "/tmp/ft_malloc_statsXXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1);
+  unlink(path);
+  fflush(NULL);
+  pid_t pid = fork();
+  CHECK(pid != -1);
+  if (pid == 0) {
+    dup2(fd, 2);
+    fn();
+    exit(0);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ssize_t len = pread(fd, report, sizeof(report) - 1, 0);
+  CHECK(len >= 0);
+  report[len] = 0;
+  close(fd);
+  return report;
+}
+
+static unsigned long get_calls(const char* report, const char* name) {
+  char line[64];
+  snprintf(line, sizeof(line), "\n%s: ", name);
+  const char* found = strstr(report, line);
+  return found ? strtoul(found + strlen(line), NULL, 10) : 0;
+}
+
+static void allocate(void) {
+  char* ptrs[100];
+  for (int i = 0; i < 100; i++) {
+    ptrs[i] = malloc(1 + i * 100);
+    ptrs[i] = realloc(ptrs[i], 2 + i * 200);
+  }
+  for (int i = 0; i < 100; i++)
+    free(ptrs[i]);
+  for (int i = 0; i < 50; i++)
+    free(malloc_tiny(32));
+  free(malloc(1 << 20));
+}
+
+static void allocate_and_show(void) {
+  allocate();
+  show_alloc_stats();
+  // the destructor prints it again
+  write(2, "--- exit\n", 9);
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  if (!getenv("FT_MALLOC_TEST_ENV")) {
+    CHECK(*capture(allocate_and_show) == '-');
+    TEST_ENV(argv, "FT_MALLOC_STATS=1");
+  }
+  const char* out = capture(allocate_and_show);
+  const char* at_exit = strstr(out, "--- exit\n");
+  CHECK(!strncmp(out, "Latency:\n", 9) && at_exit && strstr(at_exit, "Latency:\n"));
+  CHECK(get_calls(out, "malloc") >= 101);
+  CHECK(get_calls(out, "realloc") == 100);
+  CHECK(get_calls(out, "malloc fast path") == 50);
+  CHECK(get_calls(out, "free") >= 151);
+  CHECK(get_calls(out, "mmap") >= 1 && get_calls(out, "munmap") >= 1);
+  CHECK(strstr(out, "p50 < ") && strstr(out, " ns: "));
+  // keeps this process' own report at exit out of the test output
+  int null = open("/dev/null", O_WRONLY);
+  CHECK(null != -1 && dup2(null, 2) == 2);
+  return 0;
+}
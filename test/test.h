@@ -0,0 +1,64 @@
+// helpers shared by the tests, each test is a program of its own linked
+// against the lib, it fails by exiting non zero
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <malloc.h>
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+// hides where a pointer comes from, so misusing it on purpose doesn't warn
+static inline void* opaque(void* ptr) {
+  __asm__ volatile("" : "+r"(ptr));
+  return ptr;
+}
+
+// the config is read once at startup, a test that needs some FT_MALLOC_* set
+// runs itself again with them: TEST_ENV(argv, "FT_MALLOC_HARDEN=1", ...)
+#define TEST_ENV(argv, ...) test_env(argv, (const char*[]){__VA_ARGS__, NULL})
+
+static inline void test_env(char** argv, const char** env) {
+  if (getenv("FT_MALLOC_TEST_ENV"))
+    return;
+  for (; *env; env++)
+    putenv((char*)*env);
+  putenv((char*)"FT_MALLOC_TEST_ENV=1");
+  execv("/proc/self/exe", argv);
+  perror("execv");
+  exit(1);
+}
+
+// runs fn in a child with stderr silenced, the signal it died of, 0 if it
+// exited cleanly, -1 if it exited with an error
+static inline int run_child(void (*fn)(void)) {
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    struct rlimit no_core = {0, 0};
+    setrlimit(RLIMIT_CORE, &no_core);
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd != -1)
+      dup2(fd, 2);
+    fn();
+    _exit(0);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) == -1)
+    return -1;
+  if (WIFSIGNALED(status))
+    return WTERMSIG(status);
+  return WEXITSTATUS(status) ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+// zones: plain first fit by default, with FT_MALLOC_DRAIN a free chunk in a
+// fuller zone wins over the first fit, and zones that go empty lose their pages
+
+#include <stdint.h>
+#include "test.h"
+
+#define ALLOCS 200
+#define SIZE 8000
+
+static char* ptrs[ALLOCS];
+
+// the process is fresh, the first small chunk starts the pool
+static uintptr_t fill_pool(void) {
+  for (int i = 0; i < ALLOCS; i++) {
+    CHECK((ptrs[i] = malloc(SIZE)));
+    memset(ptrs[i], 'x', SIZE);
+  }
+  return (uintptr_t)ptrs[0] - 32;
+}
+
+// a 1024 page pool is cut in 64 zones of 16 pages
+static size_t get_zone(uintptr_t pool, void* ptr) {
+  return ((uintptr_t)ptr - pool) / (16 * sysconf(_SC_PAGESIZE));
+}
+
+// half of the first zone goes free, and a single chunk in the third one,
+// returns whether the next chunk of that size comes from the third zone
+static int picks_fuller_zone(uintptr_t pool) {
+  for (int i = 0; i < 8; i += 2)
+    free(ptrs[i]);
+  CHECK(get_zone(pool, ptrs[0]) == 0 && get_zone(pool, ptrs[6]) == 0 && get_zone(pool, ptrs[20]) == 2);
+  uintptr_t fuller = (uintptr_t)ptrs[20];
+  free(ptrs[20]);
+  char* p = malloc(SIZE);
+  CHECK(p);
+  int picked = (uintptr_t)p == fuller;
+  free(p);
+  return picked;
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  if (!getenv("FT_MALLOC_TEST_ENV")) {
+    CHECK(!picks_fuller_zone(fill_pool()));
+    TEST_ENV(argv, "FT_MALLOC_DRAIN=1");
+  }
+  uintptr_t pool = fill_pool();
+  CHECK(picks_fuller_zone(pool));
+  // zones 5 to 12 empty out, their pages are dropped without any trim
+  char* alias = opaque(ptrs[80]);
+  for (int i = 40; i < 110; i++)
+    free(ptrs[i]);
+  CHECK(get_zone(pool, alias) >= 5 && get_zone(pool, alias) <= 12);
+  CHECK(alias[0] == 0 && alias[SIZE - 1] == 0);
+  // the drained chunks are handed out like any other
+  for (int i = 40; i < 110; i++) {
+    CHECK((ptrs[i] = malloc(SIZE)));
+    memset(ptrs[i], 'y', SIZE);
+  }
+  for (int i = 1; i < ALLOCS; i++) {
+    if ((i % 2 || i >= 8) && i != 20)
+      free(ptrs[i]);
+  }
+  return 0;
+}